@@ -4,466 +4,4877 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <algorithm>
-#include <stack>
 #include <queue>
 #include <functional>
 #include <cctype>
-#include <memory>
 #include <map>
+#include <set>
+#include <list>
+#include <random>
+#include <cstdint>
+#include <chrono>
+#include <fstream>
+#include <thread>
+#include <cstring>
+#include <climits>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <new>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
 
-// ================= Song Metadata =================
-class Song {
+// ================= Instrumentation (Counters + Latency Histograms) =================
+// Every hot-path operation owns an OpMetric: a relaxed atomic call count and
+// a log-linear latency histogram (16 sub-buckets per power of two, so any
+// percentile is within ~6%). Reading the clock costs more than most playlist
+// edits, so sub-microsecond operations time one call in 8; counts are exact.
+// A ScopedMetric also tags the calling thread with the operation's
+// subsystem; worker threads tag themselves with a SubsystemScope. Built
+// with PLAYWISE_ALLOC_TRACKING, the global allocator charges allocations
+// to that tag (a 16-byte header and three atomic updates per allocation);
+// by default the standard allocator is left alone.
+enum Subsystem {
+    SUB_OTHER, SUB_STORE, SUB_PLAYLIST, SUB_LOOKUP, SUB_HISTORY, SUB_RATINGS, SUB_FAVORITES,
+    SUB_INGEST, SUB_SORT, SUB_SUGGEST, SUB_IMPORT, SUB_SNAPSHOT, SUB_LOG, SUBSYSTEM_COUNT
+};
+const char* const SUBSYSTEM_NAMES[SUBSYSTEM_COUNT] = {
+    "other", "store", "playlist", "lookup", "history", "ratings", "favorites",
+    "ingest", "sort", "suggest", "import", "snapshot", "log"
+};
+
+struct AllocCounters {
+    atomic<uint64_t> allocs;
+    atomic<uint64_t> frees;
+    atomic<uint64_t> allocated_bytes;
+    atomic<int64_t> live_bytes;
+};
+AllocCounters alloc_counters[SUBSYSTEM_COUNT];
+thread_local int current_subsystem = SUB_OTHER;
+
+#ifdef PLAYWISE_ALLOC_TRACKING
+// 16 bytes keeps the caller's block aligned for any fundamental type.
+struct AllocHeader {
+    uint64_t bytes;
+    uint64_t subsystem;
+};
+
+void* operator new(size_t n) {
+    AllocHeader* h = (AllocHeader*)malloc(n + sizeof(AllocHeader));
+    if (!h) throw bad_alloc();
+    h->bytes = n;
+    h->subsystem = (uint64_t)current_subsystem;
+    AllocCounters& c = alloc_counters[h->subsystem];
+    c.allocs.fetch_add(1, memory_order_relaxed);
+    c.allocated_bytes.fetch_add(n, memory_order_relaxed);
+    c.live_bytes.fetch_add((int64_t)n, memory_order_relaxed);
+    return h + 1;
+}
+// Kept out of line: once free() is inlined into a delete expression, GCC
+// reports a false new/free mismatch against the operator new above.
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void operator delete(void* p) noexcept {
+    if (!p) return;
+    AllocHeader* h = (AllocHeader*)p - 1;
+    AllocCounters& c = alloc_counters[h->subsystem];
+    c.frees.fetch_add(1, memory_order_relaxed);
+    c.live_bytes.fetch_sub((int64_t)h->bytes, memory_order_relaxed);
+    free(h);
+}
+void* operator new[](size_t n) { return operator new(n); }
+void* operator new(size_t n, const nothrow_t&) noexcept {
+    try { return operator new(n); } catch (...) { return nullptr; }
+}
+void* operator new[](size_t n, const nothrow_t&) noexcept {
+    try { return operator new(n); } catch (...) { return nullptr; }
+}
+void operator delete[](void* p) noexcept { operator delete(p); }
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+void operator delete[](void* p, size_t) noexcept { operator delete(p); }
+void operator delete(void* p, const nothrow_t&) noexcept { operator delete(p); }
+void operator delete[](void* p, const nothrow_t&) noexcept { operator delete(p); }
+#endif
+
+class LatencyHistogram {
+    static const int SUB_BITS = 4;
+    static const int OCTAVES = 40; // up to ~18 minutes in ns
+    static const int BUCKETS = (OCTAVES + 1) << SUB_BITS;
+    atomic<uint64_t> buckets[BUCKETS];
+    atomic<uint64_t> total_ns;
+    atomic<uint64_t> max_ns;
+
+    static int _bucket(uint64_t v) {
+        if (v < (1u << SUB_BITS)) return (int)v;
+        int e = 63 - __builtin_clzll(v);
+        if (e >= OCTAVES + SUB_BITS - 1) return BUCKETS - 1;
+        return ((e - SUB_BITS + 1) << SUB_BITS) + (int)((v >> (e - SUB_BITS)) & ((1u << SUB_BITS) - 1));
+    }
+    // Largest value that lands in bucket b.
+    static uint64_t _bucket_top(int b) {
+        if (b < (1 << SUB_BITS)) return (uint64_t)b;
+        int e = (b >> SUB_BITS) + SUB_BITS - 1;
+        uint64_t base = (uint64_t)((1 << SUB_BITS) + (b & ((1 << SUB_BITS) - 1))) << (e - SUB_BITS);
+        return base + ((uint64_t)1 << (e - SUB_BITS)) - 1;
+    }
+
+public:
+    LatencyHistogram() : total_ns(0), max_ns(0) {
+        for (auto& b : buckets) b.store(0, memory_order_relaxed);
+    }
+
+    void record(uint64_t ns) {
+        buckets[_bucket(ns)].fetch_add(1, memory_order_relaxed);
+        total_ns.fetch_add(ns, memory_order_relaxed);
+        uint64_t seen = max_ns.load(memory_order_relaxed);
+        while (ns > seen && !max_ns.compare_exchange_weak(seen, ns, memory_order_relaxed)) {}
+    }
+
+    uint64_t count() const {
+        uint64_t n = 0;
+        for (auto& b : buckets) n += b.load(memory_order_relaxed);
+        return n;
+    }
+    uint64_t total() const { return total_ns.load(memory_order_relaxed); }
+    uint64_t max() const { return max_ns.load(memory_order_relaxed); }
+
+    // Upper bound of the bucket holding the p-th fraction of samples.
+    uint64_t percentile(double p) const {
+        uint64_t n = count();
+        if (!n) return 0;
+        uint64_t rank = (uint64_t)(p * (n - 1)) + 1, seen = 0;
+        for (int b = 0; b < BUCKETS; ++b) {
+            seen += buckets[b].load(memory_order_relaxed);
+            if (seen >= rank) return std::min(_bucket_top(b), max());
+        }
+        return max();
+    }
+};
+
+const uint64_t SAMPLE_ALL = 0, SAMPLE_1_IN_8 = 7;
+
+struct OpMetric {
+    const char* name;
+    Subsystem subsystem;
+    uint64_t sample_mask;
+    atomic<uint64_t> calls;
+    LatencyHistogram latency;
+
+    OpMetric(const char* metric_name, Subsystem sub, uint64_t mask = SAMPLE_ALL)
+        : name(metric_name), subsystem(sub), sample_mask(mask), calls(0) {
+        registry().push_back(this);
+    }
+    static vector<OpMetric*>& registry() {
+        static vector<OpMetric*> metrics;
+        return metrics;
+    }
+};
+
+// Tags the calling thread with a subsystem while in scope. Threads start
+// untagged ("other"), so every worker entry point opens one of these.
+class SubsystemScope {
+    int saved_subsystem;
+public:
+    explicit SubsystemScope(int subsystem) : saved_subsystem(current_subsystem) {
+        current_subsystem = subsystem;
+    }
+    ~SubsystemScope() { current_subsystem = saved_subsystem; }
+    SubsystemScope(const SubsystemScope&) = delete;
+    SubsystemScope& operator=(const SubsystemScope&) = delete;
+};
+
+// Times the enclosing scope into a metric and charges its allocations to
+// the metric's subsystem.
+class ScopedMetric {
+    OpMetric& metric;
+    int saved_subsystem;
+    bool timed;
+    chrono::steady_clock::time_point start;
+public:
+    explicit ScopedMetric(OpMetric& m) : metric(m), saved_subsystem(current_subsystem) {
+        current_subsystem = m.subsystem;
+        timed = (m.calls.fetch_add(1, memory_order_relaxed) & m.sample_mask) == 0;
+        if (timed) start = chrono::steady_clock::now();
+    }
+    ~ScopedMetric() {
+        if (timed) {
+            auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+            metric.latency.record((uint64_t)max<int64_t>(ns, 0));
+        }
+        current_subsystem = saved_subsystem;
+    }
+    ScopedMetric(const ScopedMetric&) = delete;
+    ScopedMetric& operator=(const ScopedMetric&) = delete;
+};
+
+OpMetric metric_store_add("store.add_song", SUB_STORE, SAMPLE_1_IN_8);
+OpMetric metric_playlist_add("playlist.add", SUB_PLAYLIST, SAMPLE_1_IN_8);
+OpMetric metric_playlist_insert("playlist.insert", SUB_PLAYLIST, SAMPLE_1_IN_8);
+OpMetric metric_playlist_append_bulk("playlist.append_bulk", SUB_PLAYLIST);
+OpMetric metric_playlist_erase("playlist.erase", SUB_PLAYLIST, SAMPLE_1_IN_8);
+OpMetric metric_playlist_move("playlist.move", SUB_PLAYLIST);
+OpMetric metric_playlist_reverse("playlist.reverse", SUB_PLAYLIST, SAMPLE_1_IN_8);
+OpMetric metric_playlist_all_songs("playlist.all_songs", SUB_PLAYLIST);
+OpMetric metric_playlist_top_duration("playlist.top_by_duration", SUB_PLAYLIST);
+OpMetric metric_playlist_refresh_hidden("playlist.refresh_hidden", SUB_PLAYLIST);
+OpMetric metric_lookup_add("lookup.add", SUB_LOOKUP);
+OpMetric metric_lookup_add_bulk("lookup.add_bulk", SUB_LOOKUP);
+OpMetric metric_lookup_remove("lookup.remove", SUB_LOOKUP);
+OpMetric metric_lookup_get("lookup.get_by_title", SUB_LOOKUP, SAMPLE_1_IN_8);
+OpMetric metric_lookup_partial("lookup.search_partial", SUB_LOOKUP);
+OpMetric metric_lookup_prefix("lookup.search_prefix", SUB_LOOKUP);
+OpMetric metric_lookup_fuzzy("lookup.search_fuzzy", SUB_LOOKUP);
+OpMetric metric_history_play("history.play", SUB_HISTORY, SAMPLE_1_IN_8);
+OpMetric metric_history_undo("history.undo", SUB_HISTORY, SAMPLE_1_IN_8);
+OpMetric metric_history_recommend("history.recommend_next", SUB_HISTORY);
+OpMetric metric_ratings_update("ratings.insert_or_update", SUB_RATINGS, SAMPLE_1_IN_8);
+OpMetric metric_ratings_delete("ratings.delete", SUB_RATINGS, SAMPLE_1_IN_8);
+OpMetric metric_ratings_range("ratings.songs_in_range", SUB_RATINGS);
+OpMetric metric_favorites_update("favorites.add_or_update", SUB_FAVORITES, SAMPLE_1_IN_8);
+OpMetric metric_favorites_remove("favorites.remove", SUB_FAVORITES, SAMPLE_1_IN_8);
+OpMetric metric_favorites_top("favorites.top", SUB_FAVORITES);
+OpMetric metric_ingest_batch("ingest.apply_batch", SUB_INGEST);
+OpMetric metric_sort("sort.songs", SUB_SORT);
+OpMetric metric_suggest_plan("suggest.plan", SUB_SUGGEST);
+OpMetric metric_import("import.catalog", SUB_IMPORT);
+OpMetric metric_snapshot_capture("snapshot.capture", SUB_SNAPSHOT);
+OpMetric metric_snapshot_load("snapshot.load", SUB_SNAPSHOT);
+OpMetric metric_snapshot_write("snapshot.write", SUB_SNAPSHOT);
+OpMetric metric_log_append("log.append", SUB_LOG, SAMPLE_1_IN_8);
+OpMetric metric_log_commit("log.group_commit", SUB_LOG);
+OpMetric metric_log_replay("log.replay", SUB_LOG);
+
+// Human-readable table of every metric that has samples, plus allocations
+// by subsystem.
+void print_stats(ostream& out) {
+    char line[160];
+    out << "--- Operation Latency (us) ---\n";
+    snprintf(line, sizeof(line), "%-26s %10s %10s %10s %10s %12s\n", "operation", "count", "p50", "p90", "p99", "max");
+    out << line;
+    for (OpMetric* m : OpMetric::registry()) {
+        uint64_t n = m->calls.load(memory_order_relaxed);
+        if (!n) continue;
+        snprintf(line, sizeof(line), "%-26s %10llu %10.2f %10.2f %10.2f %12.2f\n", m->name, (unsigned long long)n,
+                 m->latency.percentile(0.50) / 1000.0, m->latency.percentile(0.90) / 1000.0,
+                 m->latency.percentile(0.99) / 1000.0, m->latency.max() / 1000.0);
+        out << line;
+    }
+#ifndef PLAYWISE_ALLOC_TRACKING
+    out << "--- Memory by Subsystem ---\n(allocation tracking off; build with -DPLAYWISE_ALLOC_TRACKING)\n";
+#else
+    out << "--- Memory by Subsystem ---\n";
+    snprintf(line, sizeof(line), "%-12s %12s %12s %14s %14s\n", "subsystem", "allocs", "frees", "live KB", "total KB");
+    out << line;
+    for (int s = 0; s < SUBSYSTEM_COUNT; ++s) {
+        const AllocCounters& c = alloc_counters[s];
+        snprintf(line, sizeof(line), "%-12s %12llu %12llu %14.1f %14.1f\n", SUBSYSTEM_NAMES[s],
+                 (unsigned long long)c.allocs.load(), (unsigned long long)c.frees.load(),
+                 c.live_bytes.load() / 1024.0, c.allocated_bytes.load() / 1024.0);
+        out << line;
+    }
+#endif
+}
+
+// One JSON object with the raw numbers (latencies in ns, over the timed
+// samples; count is every call).
+void dump_stats_json(ostream& out) {
+    out << "{\"operations\":[";
+    bool first = true;
+    for (OpMetric* m : OpMetric::registry()) {
+        const LatencyHistogram& h = m->latency;
+        out << (first ? "" : ",") << "{\"name\":\"" << m->name << "\",\"subsystem\":\""
+            << SUBSYSTEM_NAMES[m->subsystem] << "\",\"count\":" << m->calls.load() << ",\"samples\":" << h.count()
+            << ",\"sample_total_ns\":" << h.total()
+            << ",\"p50_ns\":" << h.percentile(0.50) << ",\"p90_ns\":" << h.percentile(0.90)
+            << ",\"p99_ns\":" << h.percentile(0.99) << ",\"p999_ns\":" << h.percentile(0.999)
+            << ",\"max_ns\":" << h.max() << "}";
+        first = false;
+    }
+    out << "],\"memory\":[";
+    for (int s = 0; s < SUBSYSTEM_COUNT; ++s) {
+        const AllocCounters& c = alloc_counters[s];
+        out << (s ? "," : "") << "{\"subsystem\":\"" << SUBSYSTEM_NAMES[s] << "\",\"allocs\":" << c.allocs.load()
+            << ",\"frees\":" << c.frees.load() << ",\"live_bytes\":" << c.live_bytes.load()
+            << ",\"allocated_bytes\":" << c.allocated_bytes.load() << "}";
+    }
+#ifdef PLAYWISE_ALLOC_TRACKING
+    out << "],\"alloc_tracking\":true}\n";
+#else
+    out << "],\"alloc_tracking\":false}\n";
+#endif
+}
+
+
+// ================= Song Store (Struct of Arrays) =================
+// Songs are dense 32-bit ids into columnar arrays owned by one SongStore;
+// every other module holds ids only. Id 0 is reserved as "no song".
+typedef uint32_t SongId;
+const SongId NO_SONG = 0;
+
+// Interns each distinct string once; ids index into the pool.
+class StringPool {
+    unordered_map<string, uint32_t> ids;
+    vector<const string*> by_id; // points at the map's keys (node-stable)
+public:
+    uint32_t intern(const string& s) {
+        auto it = ids.find(s);
+        if (it != ids.end()) return it->second;
+        uint32_t id = (uint32_t)by_id.size();
+        it = ids.emplace(s, id).first;
+        by_id.push_back(&it->first);
+        return id;
+    }
+    bool find(const string& s, uint32_t& id) const {
+        auto it = ids.find(s);
+        if (it == ids.end()) return false;
+        id = it->second;
+        return true;
+    }
+    const string& get(uint32_t id) const { return *by_id[id]; }
+    size_t size() const { return by_id.size(); }
+};
+
+// Case folding for every normalized key (duplicate checks, lookup,
+// blocklist). ASCII runs are folded 16 bytes at a time (SSE2, or 8 at a
+// time with SWAR elsewhere or under PLAYWISE_NO_SIMD); any other UTF-8
+// sequence is decoded and folded with Unicode simple case folding
+// (CaseFolding.txt statuses C and S, Unicode 14). Malformed bytes are
+// copied through unchanged.
+struct FoldRange {
+    uint32_t lo, hi;
+    int32_t delta;
+    bool alternating; // only lo, lo + 2, ... fold (upper/lower pairs)
+};
+
+// Sorted, non-overlapping runs of code points that fold by the same delta.
+static const FoldRange FOLD_RANGES[] = {
+    {0x41, 0x5A, 32, false}, {0xB5, 0xB5, 775, false}, {0xC0, 0xD6, 32, false},
+    {0xD8, 0xDE, 32, false}, {0x100, 0x12E, 1, true}, {0x132, 0x136, 1, true},
+    {0x139, 0x147, 1, true}, {0x14A, 0x176, 1, true}, {0x178, 0x178, -121, false},
+    {0x179, 0x17D, 1, true}, {0x17F, 0x17F, -268, false}, {0x181, 0x181, 210, false},
+    {0x182, 0x184, 1, true}, {0x186, 0x186, 206, false}, {0x187, 0x187, 1, false},
+    {0x189, 0x18A, 205, false}, {0x18B, 0x18B, 1, false}, {0x18E, 0x18E, 79, false},
+    {0x18F, 0x18F, 202, false}, {0x190, 0x190, 203, false}, {0x191, 0x191, 1, false},
+    {0x193, 0x193, 205, false}, {0x194, 0x194, 207, false}, {0x196, 0x196, 211, false},
+    {0x197, 0x197, 209, false}, {0x198, 0x198, 1, false}, {0x19C, 0x19C, 211, false},
+    {0x19D, 0x19D, 213, false}, {0x19F, 0x19F, 214, false}, {0x1A0, 0x1A4, 1, true},
+    {0x1A6, 0x1A6, 218, false}, {0x1A7, 0x1A7, 1, false}, {0x1A9, 0x1A9, 218, false},
+    {0x1AC, 0x1AC, 1, false}, {0x1AE, 0x1AE, 218, false}, {0x1AF, 0x1AF, 1, false},
+    {0x1B1, 0x1B2, 217, false}, {0x1B3, 0x1B5, 1, true}, {0x1B7, 0x1B7, 219, false},
+    {0x1B8, 0x1B8, 1, false}, {0x1BC, 0x1BC, 1, false}, {0x1C4, 0x1C4, 2, false},
+    {0x1C5, 0x1C5, 1, false}, {0x1C7, 0x1C7, 2, false}, {0x1C8, 0x1C8, 1, false},
+    {0x1CA, 0x1CA, 2, false}, {0x1CB, 0x1DB, 1, true}, {0x1DE, 0x1EE, 1, true},
+    {0x1F1, 0x1F1, 2, false}, {0x1F2, 0x1F4, 1, true}, {0x1F6, 0x1F6, -97, false},
+    {0x1F7, 0x1F7, -56, false}, {0x1F8, 0x21E, 1, true}, {0x220, 0x220, -130, false},
+    {0x222, 0x232, 1, true}, {0x23A, 0x23A, 10795, false}, {0x23B, 0x23B, 1, false},
+    {0x23D, 0x23D, -163, false}, {0x23E, 0x23E, 10792, false}, {0x241, 0x241, 1, false},
+    {0x243, 0x243, -195, false}, {0x244, 0x244, 69, false}, {0x245, 0x245, 71, false},
+    {0x246, 0x24E, 1, true}, {0x345, 0x345, 116, false}, {0x370, 0x372, 1, true},
+    {0x376, 0x376, 1, false}, {0x37F, 0x37F, 116, false}, {0x386, 0x386, 38, false},
+    {0x388, 0x38A, 37, false}, {0x38C, 0x38C, 64, false}, {0x38E, 0x38F, 63, false},
+    {0x391, 0x3A1, 32, false}, {0x3A3, 0x3AB, 32, false}, {0x3C2, 0x3C2, 1, false},
+    {0x3CF, 0x3CF, 8, false}, {0x3D0, 0x3D0, -30, false}, {0x3D1, 0x3D1, -25, false},
+    {0x3D5, 0x3D5, -15, false}, {0x3D6, 0x3D6, -22, false}, {0x3D8, 0x3EE, 1, true},
+    {0x3F0, 0x3F0, -54, false}, {0x3F1, 0x3F1, -48, false}, {0x3F4, 0x3F4, -60, false},
+    {0x3F5, 0x3F5, -64, false}, {0x3F7, 0x3F7, 1, false}, {0x3F9, 0x3F9, -7, false},
+    {0x3FA, 0x3FA, 1, false}, {0x3FD, 0x3FF, -130, false}, {0x400, 0x40F, 80, false},
+    {0x410, 0x42F, 32, false}, {0x460, 0x480, 1, true}, {0x48A, 0x4BE, 1, true},
+    {0x4C0, 0x4C0, 15, false}, {0x4C1, 0x4CD, 1, true}, {0x4D0, 0x52E, 1, true},
+    {0x531, 0x556, 48, false}, {0x10A0, 0x10C5, 7264, false}, {0x10C7, 0x10C7, 7264, false},
+    {0x10CD, 0x10CD, 7264, false}, {0x13F8, 0x13FD, -8, false}, {0x1C80, 0x1C80, -6222, false},
+    {0x1C81, 0x1C81, -6221, false}, {0x1C82, 0x1C82, -6212, false}, {0x1C83, 0x1C84, -6210, false},
+    {0x1C85, 0x1C85, -6211, false}, {0x1C86, 0x1C86, -6204, false}, {0x1C87, 0x1C87, -6180, false},
+    {0x1C88, 0x1C88, 35267, false}, {0x1C90, 0x1CBA, -3008, false}, {0x1CBD, 0x1CBF, -3008, false},
+    {0x1E00, 0x1E94, 1, true}, {0x1E9B, 0x1E9B, -58, false}, {0x1E9E, 0x1E9E, -7615, false},
+    {0x1EA0, 0x1EFE, 1, true}, {0x1F08, 0x1F0F, -8, false}, {0x1F18, 0x1F1D, -8, false},
+    {0x1F28, 0x1F2F, -8, false}, {0x1F38, 0x1F3F, -8, false}, {0x1F48, 0x1F4D, -8, false},
+    {0x1F59, 0x1F5F, -8, true}, {0x1F68, 0x1F6F, -8, false}, {0x1F88, 0x1F8F, -8, false},
+    {0x1F98, 0x1F9F, -8, false}, {0x1FA8, 0x1FAF, -8, false}, {0x1FB8, 0x1FB9, -8, false},
+    {0x1FBA, 0x1FBB, -74, false}, {0x1FBC, 0x1FBC, -9, false}, {0x1FBE, 0x1FBE, -7173, false},
+    {0x1FC8, 0x1FCB, -86, false}, {0x1FCC, 0x1FCC, -9, false}, {0x1FD8, 0x1FD9, -8, false},
+    {0x1FDA, 0x1FDB, -100, false}, {0x1FE8, 0x1FE9, -8, false}, {0x1FEA, 0x1FEB, -112, false},
+    {0x1FEC, 0x1FEC, -7, false}, {0x1FF8, 0x1FF9, -128, false}, {0x1FFA, 0x1FFB, -126, false},
+    {0x1FFC, 0x1FFC, -9, false}, {0x2126, 0x2126, -7517, false}, {0x212A, 0x212A, -8383, false},
+    {0x212B, 0x212B, -8262, false}, {0x2132, 0x2132, 28, false}, {0x2160, 0x216F, 16, false},
+    {0x2183, 0x2183, 1, false}, {0x24B6, 0x24CF, 26, false}, {0x2C00, 0x2C2F, 48, false},
+    {0x2C60, 0x2C60, 1, false}, {0x2C62, 0x2C62, -10743, false}, {0x2C63, 0x2C63, -3814, false},
+    {0x2C64, 0x2C64, -10727, false}, {0x2C67, 0x2C6B, 1, true}, {0x2C6D, 0x2C6D, -10780, false},
+    {0x2C6E, 0x2C6E, -10749, false}, {0x2C6F, 0x2C6F, -10783, false},
+    {0x2C70, 0x2C70, -10782, false}, {0x2C72, 0x2C72, 1, false}, {0x2C75, 0x2C75, 1, false},
+    {0x2C7E, 0x2C7F, -10815, false}, {0x2C80, 0x2CE2, 1, true}, {0x2CEB, 0x2CED, 1, true},
+    {0x2CF2, 0x2CF2, 1, false}, {0xA640, 0xA66C, 1, true}, {0xA680, 0xA69A, 1, true},
+    {0xA722, 0xA72E, 1, true}, {0xA732, 0xA76E, 1, true}, {0xA779, 0xA77B, 1, true},
+    {0xA77D, 0xA77D, -35332, false}, {0xA77E, 0xA786, 1, true}, {0xA78B, 0xA78B, 1, false},
+    {0xA78D, 0xA78D, -42280, false}, {0xA790, 0xA792, 1, true}, {0xA796, 0xA7A8, 1, true},
+    {0xA7AA, 0xA7AA, -42308, false}, {0xA7AB, 0xA7AB, -42319, false},
+    {0xA7AC, 0xA7AC, -42315, false}, {0xA7AD, 0xA7AD, -42305, false},
+    {0xA7AE, 0xA7AE, -42308, false}, {0xA7B0, 0xA7B0, -42258, false},
+    {0xA7B1, 0xA7B1, -42282, false}, {0xA7B2, 0xA7B2, -42261, false}, {0xA7B3, 0xA7B3, 928, false},
+    {0xA7B4, 0xA7C2, 1, true}, {0xA7C4, 0xA7C4, -48, false}, {0xA7C5, 0xA7C5, -42307, false},
+    {0xA7C6, 0xA7C6, -35384, false}, {0xA7C7, 0xA7C9, 1, true}, {0xA7D0, 0xA7D0, 1, false},
+    {0xA7D6, 0xA7D8, 1, true}, {0xA7F5, 0xA7F5, 1, false}, {0xAB70, 0xABBF, -38864, false},
+    {0xFF21, 0xFF3A, 32, false}, {0x10400, 0x10427, 40, false}, {0x104B0, 0x104D3, 40, false},
+    {0x10570, 0x1057A, 39, false}, {0x1057C, 0x1058A, 39, false}, {0x1058C, 0x10592, 39, false},
+    {0x10594, 0x10595, 39, false}, {0x10C80, 0x10CB2, 64, false}, {0x118A0, 0x118BF, 32, false},
+    {0x16E40, 0x16E5F, 32, false}, {0x1E900, 0x1E921, 34, false},
+};
+
+const size_t FOLD_RANGE_COUNT = sizeof(FOLD_RANGES) / sizeof(FOLD_RANGES[0]);
+
+static uint32_t fold_code_point(uint32_t c) {
+    size_t lo = 0, hi = FOLD_RANGE_COUNT;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (FOLD_RANGES[mid].hi < c) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == FOLD_RANGE_COUNT) return c;
+    const FoldRange& r = FOLD_RANGES[lo];
+    if (c < r.lo || (r.alternating && (c - r.lo) % 2)) return c;
+    return (uint32_t)((int32_t)c + r.delta);
+}
+
+// Decodes one UTF-8 sequence; returns its length, or 0 if malformed.
+static size_t decode_utf8(const unsigned char* p, const unsigned char* end, uint32_t& c) {
+    size_t len = *p >= 0xF0 ? 4 : *p >= 0xE0 ? 3 : *p >= 0xC0 ? 2 : 0;
+    if (!len || *p > 0xF4 || (size_t)(end - p) < len) return 0;
+    c = *p & (0x7F >> len);
+    for (size_t i = 1; i < len; ++i) {
+        if ((p[i] & 0xC0) != 0x80) return 0;
+        c = (c << 6) | (p[i] & 0x3F);
+    }
+    static const uint32_t min_for_len[5] = {0, 0, 0x80, 0x800, 0x10000};
+    if (c < min_for_len[len] || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) return 0;
+    return len;
+}
+
+static void append_utf8(string& out, uint32_t c) {
+    if (c < 0x80) out += (char)c;
+    else if (c < 0x800) { out += (char)(0xC0 | (c >> 6)); out += (char)(0x80 | (c & 0x3F)); }
+    else if (c < 0x10000) {
+        out += (char)(0xE0 | (c >> 12)); out += (char)(0x80 | ((c >> 6) & 0x3F));
+        out += (char)(0x80 | (c & 0x3F));
+    } else {
+        out += (char)(0xF0 | (c >> 18)); out += (char)(0x80 | ((c >> 12) & 0x3F));
+        out += (char)(0x80 | ((c >> 6) & 0x3F)); out += (char)(0x80 | (c & 0x3F));
+    }
+}
+
+// Appends the case-folded form of [s, s + n) to out.
+void fold_case_append(const char* s, size_t n, string& out) {
+    const unsigned char* p = (const unsigned char*)s;
+    const unsigned char* end = p + n;
+    out.reserve(out.size() + n);
+    while (p < end) {
+#if defined(__SSE2__) && !defined(PLAYWISE_NO_SIMD)
+        while (end - p >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)p);
+            if (_mm_movemask_epi8(v)) break;
+            __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                          _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+            v = _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+            size_t pos = out.size();
+            out.resize(pos + 16);
+            _mm_storeu_si128((__m128i*)&out[pos], v);
+            p += 16;
+        }
+#else
+        while (end - p >= 8) {
+            uint64_t v;
+            memcpy(&v, p, 8);
+            if (v & 0x8080808080808080ULL) break;
+            uint64_t ge_a = v + 0x3F3F3F3F3F3F3F3FULL; // high bit set where byte >= 'A'
+            uint64_t gt_z = v + 0x2525252525252525ULL; // high bit set where byte > 'Z'
+            v |= ((ge_a & ~gt_z) & 0x8080808080808080ULL) >> 2;
+            out.append((const char*)&v, 8);
+            p += 8;
+        }
+#endif
+        if (p == end) break;
+        if (*p < 0x80) {
+            out += (char)(*p >= 'A' && *p <= 'Z' ? *p + 32 : *p);
+            ++p;
+            continue;
+        }
+        uint32_t c;
+        size_t len = decode_utf8(p, end, c);
+        if (!len) { out += (char)*p++; continue; }
+        append_utf8(out, fold_code_point(c));
+        p += len;
+    }
+}
+
+string fold_case(const string& s) {
+    string out;
+    fold_case_append(s.data(), s.size(), out);
+    return out;
+}
+
+// Non-owning view of characters owned elsewhere (C++14 has no
+// string_view); lookups take it so callers never build temporaries.
+struct StringRef {
+    const char* data;
+    size_t size;
+    StringRef(const string& s) : data(s.data()), size(s.size()) {}
+    StringRef(const char* s) : data(s), size(strlen(s)) {}
+    StringRef(const char* s, size_t n) : data(s), size(n) {}
+    bool equals(const string& s) const { return s.size() == size && memcmp(s.data(), data, size) == 0; }
+};
+
+// Folds s into a per-thread buffer that the next call reuses, so checks
+// against stored keys do not allocate.
+const string& fold_case_scratch(StringRef s) {
+    static thread_local string folded;
+    folded.clear();
+    fold_case_append(s.data, s.size, folded);
+    return folded;
+}
+
+// Open-addressing multimap from a 32-bit key hash to song ids: linear
+// probing over 8-byte slots, backward-shift deletion (no tombstones), at
+// most 3/4 full. Keys are not stored; callers confirm each candidate
+// against the song's own folded strings, so a probe run only holds the
+// songs of one key plus the odd hash collision.
+class FlatSongTable {
+    struct Slot {
+        uint32_t hash;
+        SongId song; // NO_SONG marks an empty slot
+    };
+    vector<Slot> slots;
+    size_t count;
+
+    size_t _mask() const { return slots.size() - 1; }
+
+    void _rehash(size_t capacity) {
+        vector<Slot> old(capacity, Slot{0, NO_SONG});
+        old.swap(slots);
+        for (const Slot& e : old)
+            if (e.song != NO_SONG) _place(e);
+    }
+    void _place(Slot e) {
+        size_t i = e.hash & _mask();
+        while (slots[i].song != NO_SONG) i = (i + 1) & _mask();
+        slots[i] = e;
+    }
+
+public:
+    FlatSongTable() : slots(16, Slot{0, NO_SONG}), count(0) {}
+
+    static uint32_t hash_of(StringRef s) {
+        uint64_t h = 0x9E3779B97F4A7C15ULL ^ s.size;
+        size_t i = 0;
+        for (; i + 8 <= s.size; i += 8) {
+            uint64_t w;
+            memcpy(&w, s.data + i, 8);
+            h = (h ^ w) * 0xBF58476D1CE4E5B9ULL;
+            h ^= h >> 31;
+        }
+        uint64_t tail = 0;
+        memcpy(&tail, s.data + i, s.size - i);
+        h = (h ^ tail) * 0x94D049BB133111EBULL;
+        return (uint32_t)(h ^ (h >> 32));
+    }
+    // Composite key of an already folded (title, artist) pair.
+    static uint32_t hash_of(StringRef title, StringRef artist) {
+        uint64_t h = ((uint64_t)hash_of(title) << 32 | hash_of(artist)) * 0xBF58476D1CE4E5B9ULL;
+        return (uint32_t)(h ^ (h >> 32));
+    }
+
+    // Sizes the table for n entries in total, so a bulk load never rehashes.
+    void reserve(size_t n) {
+        size_t capacity = slots.size();
+        while (capacity * 3 < n * 4) capacity *= 2;
+        if (capacity != slots.size()) _rehash(capacity);
+    }
+
+    void clear() {
+        slots.assign(16, Slot{0, NO_SONG});
+        count = 0;
+    }
+
+    void insert(uint32_t hash, SongId song) {
+        reserve(count + 1);
+        _place(Slot{hash, song});
+        count++;
+    }
+
+    bool erase(uint32_t hash, SongId song) {
+        size_t i = hash & _mask();
+        while (slots[i].song != song || slots[i].hash != hash) {
+            if (slots[i].song == NO_SONG) return false;
+            i = (i + 1) & _mask();
+        }
+        // Pull later entries of the run back so no probe sequence breaks.
+        for (size_t j = (i + 1) & _mask(); slots[j].song != NO_SONG; j = (j + 1) & _mask()) {
+            size_t home = slots[j].hash & _mask();
+            if (((j - home) & _mask()) >= ((j - i) & _mask())) {
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+        slots[i].song = NO_SONG;
+        count--;
+        return true;
+    }
+
+    // Calls fn(song) for every entry stored under hash.
+    template <typename Fn>
+    void for_each(uint32_t hash, Fn fn) const {
+        for (size_t i = hash & _mask(); slots[i].song != NO_SONG; i = (i + 1) & _mask())
+            if (slots[i].hash == hash) fn(slots[i].song);
+    }
+
+    // The first entry under hash that same(song) accepts, or nullptr. The
+    // song may be replaced in place by another with the same key.
+    template <typename Same>
+    SongId* find(uint32_t hash, Same same) {
+        for (size_t i = hash & _mask(); slots[i].song != NO_SONG; i = (i + 1) & _mask())
+            if (slots[i].hash == hash && same(slots[i].song)) return &slots[i].song;
+        return nullptr;
+    }
+    template <typename Same>
+    SongId find(uint32_t hash, Same same) const {
+        SongId* slot = const_cast<FlatSongTable*>(this)->find(hash, same);
+        return slot ? *slot : NO_SONG;
+    }
+
+    size_t size() const { return count; }
+};
+
+// Artist secondary index: every interned artist string maps to an artist
+// key (artists compare by folded name), each key lists its songs, and
+// the blocklist is one bit per key. Blocked checks by song are two array
+// reads and a bit test.
+class ArtistIndex {
+public:
+    static const uint32_t NO_KEY = UINT32_MAX;
+
+private:
+    unordered_map<string, uint32_t> key_by_name; // folded name -> key
+    vector<string> names;                // first spelling seen, by key
+    vector<const string*> folded_names;  // key_by_name's own keys, by key
+    vector<uint32_t> key_by_ref;         // interned artist ref -> key
+    vector<vector<SongId>> songs_by_key;
+    vector<uint64_t> blocked_bits;
+
+    uint32_t _key(const string& name) {
+        const string& folded = fold_case_scratch(name);
+        auto it = key_by_name.find(folded);
+        if (it != key_by_name.end()) return it->second;
+        uint32_t key = (uint32_t)names.size();
+        folded_names.push_back(&key_by_name.emplace(folded, key).first->first);
+        names.push_back(name);
+        songs_by_key.emplace_back();
+        if (blocked_bits.size() * 64 <= key) blocked_bits.push_back(0);
+        return key;
+    }
+
+public:
+    void add_song(SongId id, uint32_t artist_ref, const string& artist) {
+        if (artist_ref >= key_by_ref.size()) key_by_ref.resize(artist_ref + 1, (uint32_t)NO_KEY);
+        uint32_t& key = key_by_ref[artist_ref];
+        if (key == NO_KEY) key = _key(artist);
+        songs_by_key[key].push_back(id);
+    }
+
+    // Drops song lists and ref mappings (before a store rebuild); artist
+    // keys and blocked bits are kept.
+    void reset_songs() {
+        key_by_ref.clear();
+        for (auto& songs : songs_by_key) songs.clear();
+    }
+
+    bool is_blocked_key(uint32_t key) const {
+        return key != NO_KEY && (blocked_bits[key / 64] >> (key % 64)) & 1;
+    }
+    bool is_blocked_ref(uint32_t artist_ref) const {
+        return artist_ref < key_by_ref.size() && is_blocked_key(key_by_ref[artist_ref]);
+    }
+    uint32_t key_of_ref(uint32_t artist_ref) const {
+        return artist_ref < key_by_ref.size() ? key_by_ref[artist_ref] : (uint32_t)NO_KEY;
+    }
+    bool find_key(StringRef artist, uint32_t& key) const {
+        auto it = key_by_name.find(fold_case_scratch(artist));
+        if (it == key_by_name.end()) return false;
+        key = it->second;
+        return true;
+    }
+    const string& name_of(uint32_t key) const { return names[key]; }
+    const string& folded_name_of(uint32_t key) const { return *folded_names[key]; }
+    const vector<SongId>& songs_of(uint32_t key) const { return songs_by_key[key]; }
+    bool is_blocked_name(const string& artist) const {
+        auto it = key_by_name.find(fold_case_scratch(artist));
+        return it != key_by_name.end() && is_blocked_key(it->second);
+    }
+
+    // Sets the artist's blocked bit and returns its songs, or nullptr if
+    // the bit was already in that state.
+    const vector<SongId>* set_blocked(const string& artist, bool blocked) {
+        uint32_t key = _key(artist);
+        if (is_blocked_key(key) == blocked) return nullptr;
+        blocked_bits[key / 64] ^= uint64_t(1) << (key % 64);
+        return &songs_by_key[key];
+    }
+
+    vector<string> blocked_names() const {
+        vector<string> out;
+        for (uint32_t key = 0; key < names.size(); ++key)
+            if (is_blocked_key(key)) out.push_back(names[key]);
+        return out;
+    }
+
+    template <typename Fn>
+    void for_each_blocked_song(Fn fn) const {
+        for (uint32_t key = 0; key < names.size(); ++key)
+            if (is_blocked_key(key))
+                for (SongId s : songs_by_key[key]) fn(s);
+    }
+};
+
+class SongStore {
+    StringPool strings;
+    ArtistIndex artists;
+    vector<uint32_t> title_refs;
+    vector<uint32_t> artist_refs;
+    vector<uint32_t> folded_title_refs; // fold_case(title), interned once per song
+    vector<int> durations;     // seconds
+    vector<int> ratings;       // 1-5 or 0/unrated
+    vector<int> listen_times;  // total seconds listened
+    vector<SongId> canonical_ids; // first song with the same key
+    FlatSongTable first_by_key;   // song_key() hash -> first song with it
+
+    bool _has_key(SongId id, StringRef title, StringRef artist) const {
+        return title.equals(folded_title(id)) && artist.equals(folded_artist(id));
+    }
+    // The first song with this folded (title, artist), or NO_SONG.
+    SongId _find(StringRef title, StringRef artist) const {
+        return first_by_key.find(FlatSongTable::hash_of(title, artist),
+                                 [&](SongId s) { return _has_key(s, title, artist); });
+    }
+    // The first song with id's key; id itself if it is the first.
+    SongId _claim_key(SongId id) {
+        const string& title = folded_title(id);
+        const string& artist = folded_artist(id);
+        SongId first = _find(title, artist);
+        if (first) return first;
+        first_by_key.insert(FlatSongTable::hash_of(title, artist), id);
+        return id;
+    }
+
+public:
+    SongStore() { _append(0, 0, 0, 0, NO_SONG); } // slot 0 backs NO_SONG
+
+    // Case-folded "title\x1fartist"; songs with equal keys are duplicates.
+    static void song_key(const string& title, const string& artist, string& key) {
+        key.clear();
+        fold_case_append(title.data(), title.size(), key);
+        key += '\x1f';
+        fold_case_append(artist.data(), artist.size(), key);
+    }
+    static string song_key(const string& title, const string& artist) {
+        string key;
+        song_key(title, artist, key);
+        return key;
+    }
+
+    // The song is matched against earlier ones by its folded title and its
+    // artist's folded name, both of which the store keeps anyway.
+    SongId add_song(const string& title, const string& artist, int duration) {
+        ScopedMetric timer(metric_store_add);
+        SongId id = (SongId)durations.size();
+        uint32_t artist_ref = strings.intern(artist);
+        _append(strings.intern(title), artist_ref, strings.intern(fold_case_scratch(title)), duration, id);
+        artists.add_song(id, artist_ref, strings.get(artist_ref));
+        canonical_ids[id] = _claim_key(id);
+        return id;
+    }
+
+    void reserve(size_t n) {
+        title_refs.reserve(n + 1); artist_refs.reserve(n + 1); folded_title_refs.reserve(n + 1);
+        durations.reserve(n + 1); ratings.reserve(n + 1); listen_times.reserve(n + 1);
+        canonical_ids.reserve(n + 1); first_by_key.reserve(n);
+    }
+
+    // A title or artist may itself contain the separator, so every split
+    // is tried; almost always there is just one.
+    SongId find_by_key(const string& key) const {
+        for (size_t sep = key.find('\x1f'); sep != string::npos; sep = key.find('\x1f', sep + 1)) {
+            SongId song = _find(StringRef(key.data(), sep), StringRef(key.data() + sep + 1, key.size() - sep - 1));
+            if (song) return song;
+        }
+        return NO_SONG;
+    }
+    SongId find_song(const string& title, const string& artist) const {
+        static thread_local string folded_title, folded_artist;
+        folded_title.clear();
+        fold_case_append(title.data(), title.size(), folded_title);
+        folded_artist.clear();
+        fold_case_append(artist.data(), artist.size(), folded_artist);
+        return _find(folded_title, folded_artist);
+    }
+    // The first song added with this song's key; playlists use it to
+    // detect duplicates.
+    SongId canonical(SongId id) const { return canonical_ids[id]; }
+
+    bool valid(SongId id) const { return id != NO_SONG && id < durations.size(); }
+    size_t size() const { return durations.size() - 1; }
+    size_t capacity_ids() const { return durations.size(); }
+
+    const string& title(SongId id) const { return strings.get(title_refs[id]); }
+    const string& artist(SongId id) const { return strings.get(artist_refs[id]); }
+    uint32_t title_ref(SongId id) const { return title_refs[id]; }
+    uint32_t artist_ref(SongId id) const { return artist_refs[id]; }
+    const string& folded_title(SongId id) const { return strings.get(folded_title_refs[id]); }
+    const string& folded_artist(SongId id) const {
+        static const string none;
+        uint32_t key = artist_key(id);
+        return key != ArtistIndex::NO_KEY ? artists.folded_name_of(key) : none;
+    }
+    uint32_t folded_title_ref(SongId id) const { return folded_title_refs[id]; }
+    int duration(SongId id) const { return durations[id]; }
+    int rating(SongId id) const { return ratings[id]; }
+    int listen_time(SongId id) const { return listen_times[id]; }
+
+    void set_rating(SongId id, int r) { ratings[id] = r; }
+    void add_listen_time(SongId id, int seconds) { listen_times[id] += seconds; }
+
+    bool is_blocked(SongId id) const { return artists.is_blocked_ref(artist_refs[id]); }
+    uint32_t artist_key(SongId id) const { return artists.key_of_ref(artist_refs[id]); }
+    ArtistIndex& artist_index() { return artists; }
+    const ArtistIndex& artist_index() const { return artists; }
+
+    const StringPool& string_pool() const { return strings; }
+    const vector<uint32_t>& title_ref_column() const { return title_refs; }
+    const vector<uint32_t>& artist_ref_column() const { return artist_refs; }
+    const vector<int>& duration_column() const { return durations; }
+    const vector<int>& rating_column() const { return ratings; }
+    const vector<int>& listen_time_column() const { return listen_times; }
+
+    string display(SongId id) const {
+        return title(id) + " by " + artist(id) + " (" + to_string(duration(id)) + " sec)";
+    }
+
+    // Replaces the string pool and every column with snapshot data; slots
+    // counts slot 0 too and the string refs index pool.
+    void restore_columns(StringPool&& pool, const uint32_t* title, const uint32_t* artist,
+                         const int32_t* duration, const int32_t* rating, const int32_t* listen_time,
+                         size_t slots) {
+        strings = std::move(pool);
+        title_refs.assign(title, title + slots);
+        artist_refs.assign(artist, artist + slots);
+        durations.assign(duration, duration + slots);
+        ratings.assign(rating, rating + slots);
+        listen_times.assign(listen_time, listen_time + slots);
+        artists.reset_songs();
+        first_by_key.clear();
+        first_by_key.reserve(slots);
+        canonical_ids.assign(slots, NO_SONG);
+        folded_title_refs.assign(slots, 0);
+        for (SongId id = 1; id < slots; ++id) {
+            artists.add_song(id, artist_refs[id], strings.get(artist_refs[id]));
+            folded_title_refs[id] = strings.intern(fold_case_scratch(strings.get(title_refs[id])));
+            canonical_ids[id] = _claim_key(id);
+        }
+    }
+
+private:
+    void _append(uint32_t title_ref, uint32_t artist_ref, uint32_t folded_title_ref, int duration,
+                 SongId canonical) {
+        canonical_ids.push_back(canonical);
+        title_refs.push_back(title_ref);
+        artist_refs.push_back(artist_ref);
+        folded_title_refs.push_back(folded_title_ref);
+        durations.push_back(duration);
+        ratings.push_back(0);
+        listen_times.push_back(0);
+    }
+};
+
+// ================= Output Buffer (Batched Writes) =================
+// Collects output in one reusable buffer and hands it to the stream in
+// large writes, so listing a million songs costs a few writes rather
+// than one per line. Nothing is flushed per line: call flush() (or let
+// the buffer go out of scope) before writing to the stream directly.
+class OutputBuffer {
+    ostream& out;
+    string buf;
+
+    OutputBuffer& _maybe_flush() {
+        if (buf.size() >= CAPACITY) flush();
+        return *this;
+    }
+
+public:
+    static const size_t CAPACITY = 1 << 20;
+
+    explicit OutputBuffer(ostream& stream) : out(stream) { buf.reserve(CAPACITY + 4096); }
+    ~OutputBuffer() { flush(); }
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    OutputBuffer& operator<<(const string& s) { buf += s; return _maybe_flush(); }
+    OutputBuffer& operator<<(const char* s) { buf += s; return _maybe_flush(); }
+    OutputBuffer& operator<<(char c) { buf += c; return _maybe_flush(); }
+    OutputBuffer& operator<<(double v) {
+        char text[32];
+        snprintf(text, sizeof(text), "%g", v); // what ostream prints by default
+        buf += text;
+        return _maybe_flush();
+    }
+    template <typename T>
+    typename enable_if<is_integral<T>::value, OutputBuffer&>::type operator<<(T v) {
+        char digits[24];
+        char* p = digits + sizeof(digits);
+        bool negative = v < 0;
+        unsigned long long u = negative ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+        do { *--p = (char)('0' + u % 10); u /= 10; } while (u);
+        if (negative) *--p = '-';
+        buf.append(p, digits + sizeof(digits) - p);
+        return _maybe_flush();
+    }
+
+    // Appends s as a TSV field: tab, newline, CR and backslash escaped.
+    OutputBuffer& field(const string& s) {
+        for (char c : s) {
+            switch (c) {
+            case '\t': buf += "\\t"; break;
+            case '\n': buf += "\\n"; break;
+            case '\r': buf += "\\r"; break;
+            case '\\': buf += "\\\\"; break;
+            default: buf += c;
+            }
+        }
+        return _maybe_flush();
+    }
+
+    void flush() {
+        if (buf.empty()) return;
+        out.write(buf.data(), buf.size());
+        buf.clear();
+    }
+};
+
+// Same text as SongStore::display, without the temporary strings.
+OutputBuffer& render_song(OutputBuffer& out, const SongStore& store, SongId s) {
+    return out << store.title(s) << " by " << store.artist(s) << " (" << store.duration(s) << " sec)";
+}
+
+// ================= Playlist (Persistent Implicit Treap) =================
+// Order-statistic treap keyed by position: every node stores its subtree
+// size, so access / insert / erase / move are O(log n) expected, and
+// reversal is a lazy flag pushed down on the next structural edit.
+// Nodes also carry subtree duration aggregates (total, min, max), kept up
+// to date by the same _update that maintains sizes; reversal leaves them
+// unchanged. Songs of blocked artists stay in the tree as hidden nodes that
+// count towards neither size nor aggregates, so every index the user sees
+// skips them and unblocking restores them in place.
+// Nodes are reference counted and shared between playlists: copying a
+// Playlist is O(1), and an edit copies only the shared nodes on its path
+// (including children a reverse flag is pushed into) while unshared nodes
+// are updated in place.
+struct PlaylistNode {
+    SongId song;
+    unsigned priority;
+    int size;                // visible songs in the subtree
+    uint32_t refs;
+    bool reversed;
+    bool hidden;
+    int duration;
+    int min_duration;
+    int max_duration;
+    long long total_duration;
+    PlaylistNode* left;
+    PlaylistNode* right;
+    PlaylistNode(SongId s, int d, unsigned p, bool h)
+        : song(s), priority(p), size(0), refs(1), reversed(false), hidden(h),
+          duration(d), min_duration(INT_MAX), max_duration(INT_MIN), total_duration(0),
+          left(nullptr), right(nullptr) {
+        if (!hidden) { size = 1; min_duration = max_duration = d; total_duration = d; }
+    }
+};
+
+// Persistent SongId -> count map: a 16-ary radix trie over dense ids with
+// reference-counted nodes. Copies share the root; an edit copies only the
+// still-shared nodes on its path (one per level) and updates the rest in
+// place.
+class SharedCountMap {
+    static const int FANOUT = 16;
+    struct Node {
+        uint32_t refs;
+        union {
+            Node* child[FANOUT];   // interior levels
+            int count[FANOUT];     // leaf level
+        };
+        Node() : refs(1) { memset(child, 0, sizeof(child)); }
+    };
+    Node* root;
+    int height; // interior levels above the leaves
+
+    static bool _fits(uint32_t id, int height) { return height >= 7 || !(id >> (4 * (height + 1))); }
+
+    static void _release(Node* node, int level) {
+        if (!node || --node->refs > 0) return;
+        if (level > 0)
+            for (Node* c : node->child) _release(c, level - 1);
+        delete node;
+    }
+
+    // Takes an owned reference; returns one that may be modified in place.
+    static Node* _own(Node* node, int level) {
+        if (node->refs == 1) return node;
+        Node* copy = new Node(*node);
+        copy->refs = 1;
+        if (level > 0)
+            for (Node* c : copy->child) if (c) c->refs++;
+        node->refs--;
+        return copy;
+    }
+
+public:
+    SharedCountMap() : root(nullptr), height(0) {}
+    SharedCountMap(const SharedCountMap& other) : root(other.root), height(other.height) {
+        if (root) root->refs++;
+    }
+    SharedCountMap& operator=(const SharedCountMap& other) {
+        if (other.root) other.root->refs++;
+        _release(root, height);
+        root = other.root;
+        height = other.height;
+        return *this;
+    }
+    ~SharedCountMap() { _release(root, height); }
+
+    int get(uint32_t id) const {
+        if (!_fits(id, height)) return 0;
+        const Node* node = root;
+        for (int level = height; node; --level) {
+            size_t slot = (id >> (4 * level)) & (FANOUT - 1);
+            if (level == 0) return node->count[slot];
+            node = node->child[slot];
+        }
+        return 0;
+    }
+
+    // Adds delta to id's count and returns the new count.
+    int add(uint32_t id, int delta) {
+        while (!_fits(id, height)) {
+            if (root) {
+                Node* top = new Node();
+                top->child[0] = root;
+                root = top;
+            }
+            height++;
+        }
+        Node** slot = &root;
+        for (int level = height;; --level) {
+            *slot = *slot ? _own(*slot, level) : new Node();
+            size_t i = (id >> (4 * level)) & (FANOUT - 1);
+            if (level == 0) return (*slot)->count[i] += delta;
+            slot = &(*slot)->child[i];
+        }
+    }
+};
+
+class Playlist {
+private:
+    const SongStore& store;
+    PlaylistNode* root;
+    mt19937 rng;
+    // Canonical song id (one per normalized title/artist) -> occurrences,
+    // for O(1)-ish duplicate checks; shared between copies like the tree.
+    SharedCountMap members;
+
+    void _index(SongId song) { members.add(store.canonical(song), 1); }
+    void _unindex(SongId song) { members.add(store.canonical(song), -1); }
+
+    static int _size(PlaylistNode* node) { return node ? node->size : 0; }
+
+    static void _update(PlaylistNode* node) {
+        if (node->hidden) {
+            node->size = 0;
+            node->total_duration = 0;
+            node->min_duration = INT_MAX;
+            node->max_duration = INT_MIN;
+        } else {
+            node->size = 1;
+            node->total_duration = node->min_duration = node->max_duration = node->duration;
+        }
+        for (PlaylistNode* child : {node->left, node->right}) {
+            if (!child) continue;
+            node->size += child->size;
+            node->total_duration += child->total_duration;
+            node->min_duration = min(node->min_duration, child->min_duration);
+            node->max_duration = max(node->max_duration, child->max_duration);
+        }
+    }
+
+    PlaylistNode* _new_node(SongId song) {
+        return new PlaylistNode(song, store.duration(song), rng(), store.is_blocked(song));
+    }
+
+    // First song in playlist order whose duration equals the subtree
+    // aggregate picked by agg (min_duration or max_duration).
+    SongId _first_with(int PlaylistNode::*agg) const {
+        if (!root) return NO_SONG;
+        int target = root->*agg;
+        PlaylistNode* curr = root;
+        bool flipped = false;
+        while (curr) {
+            flipped = flipped != curr->reversed;
+            PlaylistNode* first = flipped ? curr->right : curr->left;
+            PlaylistNode* second = flipped ? curr->left : curr->right;
+            if (first && first->size && first->*agg == target) curr = first;
+            else if (!curr->hidden && curr->duration == target) return curr->song;
+            else curr = second;
+        }
+        return NO_SONG;
+    }
+
+    static void _retain(PlaylistNode* node) { if (node) node->refs++; }
+
+    static void _release(PlaylistNode* node) {
+        if (!node || --node->refs > 0) return;
+        _release(node->left);
+        _release(node->right);
+        delete node;
+    }
+
+    // Takes an owned reference; returns one that may be modified in place,
+    // copying the node (which then shares its children) if it is shared.
+    static PlaylistNode* _own(PlaylistNode* node) {
+        if (node->refs == 1) return node;
+        PlaylistNode* copy = new PlaylistNode(*node);
+        copy->refs = 1;
+        _retain(copy->left);
+        _retain(copy->right);
+        node->refs--;
+        return copy;
+    }
+
+    // node must be exclusively owned; children it flips are made so too.
+    static void _push(PlaylistNode* node) {
+        if (!node || !node->reversed) return;
+        swap(node->left, node->right);
+        if (node->left) { node->left = _own(node->left); node->left->reversed = !node->left->reversed; }
+        if (node->right) { node->right = _own(node->right); node->right->reversed = !node->right->reversed; }
+        node->reversed = false;
+    }
+
+    // Splits so that the first k visible songs end up in l, the rest in r.
+    // Hidden songs right after the k-th visible one go to r, or to l when
+    // hidden_left is set (so r then starts with a visible song).
+    static void _split(PlaylistNode* node, int k, PlaylistNode*& l, PlaylistNode*& r,
+                       bool hidden_left = false) {
+        if (!node) { l = r = nullptr; return; }
+        node = _own(node);
+        _push(node);
+        int before = _size(node->left);
+        if (before < k || (node->hidden && hidden_left && before == k)) {
+            _split(node->right, k - before - (node->hidden ? 0 : 1), node->right, r, hidden_left);
+            l = node;
+        } else {
+            _split(node->left, k, l, node->left, hidden_left);
+            r = node;
+        }
+        _update(node);
+    }
+
+    static PlaylistNode* _merge(PlaylistNode* l, PlaylistNode* r) {
+        if (!l) return r;
+        if (!r) return l;
+        if (l->priority > r->priority) {
+            l = _own(l);
+            _push(l);
+            l->right = _merge(l->right, r);
+            _update(l);
+            return l;
+        }
+        r = _own(r);
+        _push(r);
+        r->left = _merge(l, r->left);
+        _update(r);
+        return r;
+    }
+
+    // In-order walk that honours pending reverse flags without mutating the tree.
+    template <typename Fn>
+    static void _inorder(PlaylistNode* node, bool flipped, bool with_hidden, Fn& fn) {
+        if (!node) return;
+        flipped = flipped != node->reversed;
+        _inorder(flipped ? node->right : node->left, flipped, with_hidden, fn);
+        if (with_hidden || !node->hidden) fn(node->song);
+        _inorder(flipped ? node->left : node->right, flipped, with_hidden, fn);
+    }
+
+    template <typename Fn>
+    static void _inorder_range(PlaylistNode* node, bool flipped, size_t& skip, size_t& left, Fn& fn) {
+        if (!node || !left) return;
+        if (skip >= (size_t)node->size) { skip -= node->size; return; }
+        flipped = flipped != node->reversed;
+        _inorder_range(flipped ? node->right : node->left, flipped, skip, left, fn);
+        if (!node->hidden && left) {
+            if (skip) skip--;
+            else { fn(node->song); left--; }
+        }
+        _inorder_range(flipped ? node->left : node->right, flipped, skip, left, fn);
+    }
+
+    // Takes and returns an owned reference. Subtrees whose hidden flags do
+    // not change come back as-is, so structure shared with other playlists
+    // stays shared.
+    PlaylistNode* _refresh_hidden(PlaylistNode* node) {
+        if (!node) return nullptr;
+        bool shared = node->refs > 1;
+        PlaylistNode* left = node->left;
+        PlaylistNode* right = node->right;
+        if (shared) { _retain(left); _retain(right); }
+        else node->left = node->right = nullptr;
+        left = _refresh_hidden(left);
+        right = _refresh_hidden(right);
+        bool hidden = store.is_blocked(node->song);
+        if (shared) {
+            if (left == node->left && right == node->right && hidden == node->hidden) {
+                _release(left);
+                _release(right);
+                return node;
+            }
+            PlaylistNode* copy = new PlaylistNode(*node);
+            copy->refs = 1;
+            node->refs--;
+            node = copy;
+        }
+        node->left = left;
+        node->right = right;
+        node->hidden = hidden;
+        _update(node);
+        return node;
+    }
+
+    static void _update_all(PlaylistNode* node) {
+        if (!node) return;
+        _update_all(node->left);
+        _update_all(node->right);
+        _update(node);
+    }
+
+    // Builds a treap holding ids in order in O(n): a right-spine stack of
+    // Cartesian-tree ancestors, ordered by priority.
+    PlaylistNode* _build(const vector<SongId>& ids) {
+        vector<PlaylistNode*> spine;
+        for (SongId id : ids) {
+            PlaylistNode* node = _new_node(id);
+            PlaylistNode* last = nullptr;
+            while (!spine.empty() && spine.back()->priority < node->priority) {
+                last = spine.back();
+                spine.pop_back();
+            }
+            node->left = last;
+            if (!spine.empty()) spine.back()->right = node;
+            spine.push_back(node);
+        }
+        PlaylistNode* built = spine.empty() ? nullptr : spine.front();
+        _update_all(built);
+        return built;
+    }
+
+    PlaylistNode* _detach(int idx) {
+        PlaylistNode *l, *mid, *r;
+        _split(root, idx, l, r, true);
+        _split(r, 1, mid, r);
+        root = _merge(l, r);
+        return mid;
+    }
+
+    void _attach(int idx, PlaylistNode* node) {
+        PlaylistNode *l, *r;
+        _split(root, idx, l, r);
+        root = _merge(_merge(l, node), r);
+    }
+
+public:
+    explicit Playlist(const SongStore& s) : store(s), root(nullptr), rng(random_device{}()) {}
+    ~Playlist() { _release(root); }
+
+    // O(1): the copy shares every node; later edits on either side copy
+    // only what they touch.
+    Playlist(const Playlist& other)
+        : store(other.store), root(other.root), rng(other.rng), members(other.members) {
+        _retain(root);
+    }
+    Playlist& operator=(const Playlist& other) {
+        _retain(other.root);
+        _release(root);
+        root = other.root;
+        rng = other.rng;
+        members = other.members;
+        return *this;
+    }
+
+    bool contains(SongId song) const { return members.get(store.canonical(song)) > 0; }
+
+    bool exists_key(const string& key) const {
+        SongId song = store.find_by_key(key);
+        return song && contains(song);
+    }
+
+    bool exists(const string& title, const string& artist) const {
+        SongId song = store.find_song(title, artist);
+        return song && contains(song);
+    }
+
+    int size() const { return _size(root); }
+
+    SongId at(int idx) const {
+        if (idx < 0 || idx >= size()) return NO_SONG;
+        PlaylistNode* curr = root;
+        bool flipped = false;
+        while (curr) {
+            flipped = flipped != curr->reversed;
+            PlaylistNode* first = flipped ? curr->right : curr->left;
+            PlaylistNode* second = flipped ? curr->left : curr->right;
+            int left_size = _size(first);
+            if (idx < left_size) curr = first;
+            else if (idx == left_size && !curr->hidden) return curr->song;
+            else { idx -= left_size + (curr->hidden ? 0 : 1); curr = second; }
+        }
+        return NO_SONG;
+    }
+
+    long long total_duration() const { return root ? root->total_duration : 0; }
+
+    // Earliest (in playlist order) longest / shortest song; O(log n).
+    SongId longest_song() const { return _first_with(&PlaylistNode::max_duration); }
+    SongId shortest_song() const { return _first_with(&PlaylistNode::min_duration); }
+
+    // The k longest songs, longest first, by best-first search on subtree
+    // maxima: O(k log k) regardless of playlist size.
+    vector<SongId> top_by_duration(size_t k) const {
+        ScopedMetric timer(metric_playlist_top_duration);
+        vector<SongId> top;
+        if (!_size(root) || k == 0) return top;
+        // Entries are either a whole subtree (keyed by its max) or a single
+        // node's own song (keyed by its duration); on equal keys the single
+        // song wins, so ties do not expand more subtrees than needed.
+        typedef pair<pair<int, bool>, PlaylistNode*> Entry;
+        priority_queue<Entry> frontier;
+        frontier.push(Entry(make_pair(root->max_duration, false), root));
+        while (!frontier.empty() && top.size() < k) {
+            Entry e = frontier.top();
+            frontier.pop();
+            PlaylistNode* node = e.second;
+            if (e.first.second) { top.push_back(node->song); continue; }
+            if (!node->hidden) frontier.push(Entry(make_pair(node->duration, true), node));
+            if (_size(node->left)) frontier.push(Entry(make_pair(node->left->max_duration, false), node->left));
+            if (_size(node->right)) frontier.push(Entry(make_pair(node->right->max_duration, false), node->right));
+        }
+        return top;
+    }
+
+    void add_song(SongId song) {
+        ScopedMetric timer(metric_playlist_add);
+        root = _merge(root, _new_node(song));
+        _index(song);
+    }
+
+    // Appends the song unless an equal (title, artist) is already present.
+    bool add_unique(SongId song) {
+        if (contains(song)) return false;
+        add_song(song);
+        return true;
+    }
+
+    // Bulk append for catalog loads: the tree is built in O(n).
+    void append_bulk(const vector<SongId>& ids) {
+        ScopedMetric timer(metric_playlist_append_bulk);
+        for (SongId s : ids) _index(s);
+        root = _merge(root, _build(ids));
+    }
+
+    bool insert_song(int idx, SongId song) {
+        ScopedMetric timer(metric_playlist_insert);
+        if (idx < 0 || idx > size()) return false;
+        _attach(idx, _new_node(song));
+        _index(song);
+        return true;
+    }
+
+    SongId erase_at(int idx) {
+        ScopedMetric timer(metric_playlist_erase);
+        if (idx < 0 || idx >= size()) return NO_SONG;
+        PlaylistNode* node = _detach(idx);
+        SongId song = node->song;
+        _release(node);
+        _unindex(song);
+        return song;
+    }
+
+    void delete_song(int idx, function<void(SongId)> remove_from_lookup) {
+        if (idx < 0 || idx >= size()) {
+            cout << "\n[ERROR] Invalid index. No song deleted.\n";
+            return;
+        }
+        remove_from_lookup(erase_at(idx));
+        cout << "\n[INFO] Song deleted successfully.\n";
+    }
+
+    // Moves the song at from_idx so that it ends up at to_idx; songs in
+    // between shift by one.
+    void move_song(int from_idx, int to_idx) {
+        ScopedMetric timer(metric_playlist_move);
+        if (from_idx < 0 || from_idx >= size() || to_idx < 0 || to_idx >= size()) {
+            cout << "\n[ERROR] Invalid index. Move operation aborted.\n";
+            return;
+        }
+        if (from_idx == to_idx) {
+            cout << "\n[INFO] No movement needed (same index).\n";
+            return;
+        }
+        _attach(to_idx, _detach(from_idx));
+        cout << "\n[INFO] Song moved successfully.\n";
+    }
+
+    // Cuts count songs starting at from_idx and re-inserts the block so it
+    // starts at to_idx of the resulting playlist.
+    bool splice(int from_idx, int count, int to_idx) {
+        ScopedMetric timer(metric_playlist_move);
+        int n = size();
+        if (count <= 0 || from_idx < 0 || from_idx + count > n ||
+            to_idx < 0 || to_idx > n - count) return false;
+        PlaylistNode *l, *mid, *r;
+        _split(root, from_idx, l, r, true);
+        _split(r, count, mid, r);
+        root = _merge(l, r);
+        _attach(to_idx, mid);
+        return true;
+    }
+
+    void reverse() {
+        ScopedMetric timer(metric_playlist_reverse);
+        if (root) {
+            root = _own(root);
+            root->reversed = !root->reversed;
+        }
+    }
+
+    void reverse_playlist() {
+        reverse();
+        cout << "\n[INFO] Playlist reversed successfully.\n";
+    }
+
+    // Calls fn(song) for up to limit visible songs (0 = no limit) from
+    // position offset on and returns how many it visited. Subtrees before
+    // offset are skipped by size, so a page costs O(log n + limit).
+    template <typename Fn>
+    size_t for_each_range(size_t offset, size_t limit, Fn fn) const {
+        size_t left = limit ? limit : (size_t)size();
+        size_t visited = left;
+        _inorder_range(root, false, offset, left, fn);
+        return visited - left;
+    }
+
+    // Visible songs in order; with_hidden also returns blocked artists'
+    // songs (for snapshots).
+    vector<SongId> all_songs(bool with_hidden = false) const {
+        ScopedMetric timer(metric_playlist_all_songs);
+        vector<SongId> v;
+        v.reserve(size());
+        auto collect = [&](SongId s) { v.push_back(s); };
+        _inorder(root, false, with_hidden, collect);
+        return v;
+    }
+
+    // Re-reads every song's blocked state after the blocklist changed;
+    // one O(n) pass that also rebuilds the subtree aggregates.
+    void refresh_hidden() {
+        ScopedMetric timer(metric_playlist_refresh_hidden);
+        root = _refresh_hidden(root);
+    }
+};
+
+// ================= Playlist Library (Named Playlists) =================
+// Named playlists over the shared SongStore. Saving, opening and forking
+// copy a Playlist handle, which is O(1): versions share structure and an
+// edit copies only the nodes it touches.
+class PlaylistLibrary {
+    map<string, Playlist> playlists;
+public:
+    void save(const string& name, const Playlist& playlist) {
+        auto it = playlists.find(name);
+        if (it != playlists.end()) it->second = playlist;
+        else playlists.emplace(name, playlist);
+    }
+    const Playlist* find(const string& name) const {
+        auto it = playlists.find(name);
+        return it != playlists.end() ? &it->second : nullptr;
+    }
+    bool remove(const string& name) { return playlists.erase(name) > 0; }
+    size_t size() const { return playlists.size(); }
+    bool contains(SongId song) const {
+        for (auto& kv : playlists)
+            if (kv.second.contains(song)) return true;
+        return false;
+    }
+    const map<string, Playlist>& all() const { return playlists; }
+
+    void refresh_hidden() {
+        for (auto& kv : playlists) kv.second.refresh_hidden();
+    }
+};
+
+// ================= Song Lookup (Flat Hash + Trigram Index) =================
+// Every index is keyed by the folded title (and artist) the store computed
+// when the song was added; only the query string is folded per call.
+
+// Orders (pool string, song) entries by content, then song id;
+// transparent, so a plain string can be used for lower_bound.
+struct FoldedTitleLess {
+    typedef void is_transparent;
+    typedef pair<const string*, SongId> Entry;
+    bool operator()(const Entry& a, const Entry& b) const {
+        int c = a.first->compare(*b.first);
+        return c != 0 ? c < 0 : a.second < b.second;
+    }
+    bool operator()(const Entry& a, const string& b) const { return *a.first < b; }
+    bool operator()(const string& a, const Entry& b) const { return a < *b.first; }
+};
+
+// Bounded Levenshtein distance (in bytes) against one fixed pattern.
+// Patterns up to 64 bytes use Myers' bit-parallel algorithm, one word
+// operation sequence per text byte; longer ones use a two-row dynamic
+// program. Anything above the bound is reported as bound + 1.
+class EditDistancePattern {
+    string pattern;
+    uint64_t peq[256]; // bit i set where pattern[i] is that byte
+
+    int _dp(const string& text, int bound) const {
+        vector<int> prev(text.size() + 1), cur(text.size() + 1);
+        for (size_t j = 0; j <= text.size(); ++j) prev[j] = (int)j;
+        for (size_t i = 1; i <= pattern.size(); ++i) {
+            cur[0] = (int)i;
+            int row_min = cur[0];
+            for (size_t j = 1; j <= text.size(); ++j) {
+                cur[j] = min(min(prev[j], cur[j - 1]) + 1, prev[j - 1] + (pattern[i - 1] != text[j - 1]));
+                row_min = min(row_min, cur[j]);
+            }
+            if (row_min > bound) return bound + 1;
+            prev.swap(cur);
+        }
+        return min(prev[text.size()], bound + 1);
+    }
+
+public:
+    explicit EditDistancePattern(const string& p) : pattern(p) {
+        memset(peq, 0, sizeof(peq));
+        if (p.size() <= 64)
+            for (size_t i = 0; i < p.size(); ++i) peq[(unsigned char)p[i]] |= uint64_t(1) << i;
+    }
+
+    int distance(const string& text, int bound) const {
+        int m = (int)pattern.size(), n = (int)text.size();
+        if (abs(m - n) > bound) return bound + 1;
+        if (m == 0) return n;
+        if (m > 64) return _dp(text, bound);
+        uint64_t pv = ~uint64_t(0), mv = 0, high = uint64_t(1) << (m - 1);
+        int score = m; // distance between the pattern and text[0, j)
+        for (int j = 0; j < n; ++j) {
+            uint64_t eq = peq[(unsigned char)text[j]];
+            uint64_t xv = eq | mv;
+            uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+            uint64_t ph = mv | ~(xh | pv);
+            uint64_t mh = pv & xh;
+            if (ph & high) score++;
+            else if (mh & high) score--;
+            ph = (ph << 1) | 1;
+            mh <<= 1;
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+            // The remaining bytes can lower the score by at most one each.
+            if (score - (n - j - 1) > bound) return bound + 1;
+        }
+        return min(score, bound + 1);
+    }
+};
+
+struct FuzzyMatch {
+    SongId song;
+    int distance;
+    bool by_artist; // the artist name matched, not the title
+};
+
+// Typo budget for a query of this many bytes.
+int default_fuzzy_distance(size_t length) {
+    return length < 5 ? 1 : length < 10 ? 2 : 3;
+}
+
+class SongLookup {
+    const SongStore& store;
+    FlatSongTable by_key;      // folded (title, artist) -> indexed songs with it
+    FlatSongTable title_heads; // folded title -> first song of its chain
+    vector<SongId> title_next, title_prev; // per-title chains, by song id
+    vector<char> indexed;      // by song id
+    // (folded title pointing into the store's pool, song id) in title order,
+    // for prefix range scans.
+    set<FoldedTitleLess::Entry, FoldedTitleLess> sorted_titles;
+    // Trigram -> ascending ids of songs whose folded title contains it.
+    unordered_map<uint32_t, vector<SongId>> trigram_postings;
+    // Trigrams of folded titles (artist names) padded with two NULs on each
+    // side -> ascending song ids (artist keys). Feed the fuzzy search.
+    unordered_map<uint32_t, vector<uint32_t>> fuzzy_title_postings;
+    unordered_map<uint32_t, vector<uint32_t>> fuzzy_artist_postings;
+    vector<char> artist_indexed; // by artist key
+    // Most candidates one fuzzy search verifies per postings table.
+    static const size_t FUZZY_BUDGET = 50000;
+
+    static vector<uint32_t> trigrams(const string& s) {
+        vector<uint32_t> grams;
+        for (size_t i = 0; i + 3 <= s.size(); ++i) {
+            grams.push_back(((uint32_t)(unsigned char)s[i] << 16) |
+                            ((uint32_t)(unsigned char)s[i + 1] << 8) |
+                            (uint32_t)(unsigned char)s[i + 2]);
+        }
+        sort(grams.begin(), grams.end());
+        grams.erase(unique(grams.begin(), grams.end()), grams.end());
+        return grams;
+    }
+    // Trigrams of s with two NULs on each side, so every byte (including
+    // the first and last) is in three grams and short strings have some.
+    static vector<uint32_t> padded_trigrams(const string& s) {
+        vector<uint32_t> grams;
+        uint32_t window = 0;
+        for (size_t i = 0; i < s.size() + 2; ++i) {
+            window = ((window << 8) | (i < s.size() ? (unsigned char)s[i] : 0)) & 0xFFFFFF;
+            grams.push_back(window);
+        }
+        sort(grams.begin(), grams.end());
+        grams.erase(unique(grams.begin(), grams.end()), grams.end());
+        return grams;
+    }
+
+    static void _posting_add(vector<uint32_t>& ids, uint32_t id) {
+        if (ids.empty() || ids.back() < id) ids.push_back(id);
+        else {
+            auto pos = lower_bound(ids.begin(), ids.end(), id);
+            if (pos == ids.end() || *pos != id) ids.insert(pos, id);
+        }
+    }
+    template <typename Postings>
+    static void _posting_remove(Postings& postings, uint32_t gram, uint32_t id) {
+        auto it = postings.find(gram);
+        if (it == postings.end()) return;
+        vector<uint32_t>& ids = it->second;
+        auto pos = lower_bound(ids.begin(), ids.end(), id);
+        if (pos != ids.end() && *pos == id) ids.erase(pos);
+        if (ids.empty()) postings.erase(it);
+    }
+
+    void _index(SongId id) {
+        const string& key = store.folded_title(id);
+        if (id >= indexed.size()) {
+            indexed.resize(max<size_t>(id + 1, indexed.size() * 2), 0);
+            title_next.resize(indexed.size(), NO_SONG);
+            title_prev.resize(indexed.size(), NO_SONG);
+        }
+        indexed[id] = 1;
+        by_key.insert(FlatSongTable::hash_of(key, store.folded_artist(id)), id);
+        _link_title(id);
+        sorted_titles.emplace(&key, id);
+        for (uint32_t g : trigrams(key)) _posting_add(trigram_postings[g], id);
+        for (uint32_t g : padded_trigrams(key)) _posting_add(fuzzy_title_postings[g], id);
+        // An artist's name is indexed once, with its first song, and stays;
+        // fuzzy results only ever list songs that are still indexed.
+        uint32_t artist = store.artist_key(id);
+        if (artist == ArtistIndex::NO_KEY) return;
+        if (artist >= artist_indexed.size()) artist_indexed.resize(artist + 1, 0);
+        if (artist_indexed[artist]) return;
+        artist_indexed[artist] = 1;
+        for (uint32_t g : padded_trigrams(fold_case(store.artist_index().name_of(artist))))
+            _posting_add(fuzzy_artist_postings[g], artist);
+    }
+
+    void _unindex(SongId id) {
+        if (id >= indexed.size() || !indexed[id]) return;
+        const string& key = store.folded_title(id);
+        by_key.erase(FlatSongTable::hash_of(key, store.folded_artist(id)), id);
+        _unlink_title(id);
+        sorted_titles.erase(FoldedTitleLess::Entry(&key, id));
+        for (uint32_t g : trigrams(key)) _posting_remove(trigram_postings, g, id);
+        for (uint32_t g : padded_trigrams(key)) _posting_remove(fuzzy_title_postings, g, id);
+        indexed[id] = 0;
+    }
+
+    // Songs sharing a folded title form a doubly linked chain whose first
+    // song sits in title_heads, so title lookups never scan other titles.
+    void _link_title(SongId id) {
+        uint32_t ref = store.folded_title_ref(id);
+        uint32_t hash = FlatSongTable::hash_of(store.folded_title(id));
+        SongId* head = title_heads.find(hash, [&](SongId s) { return store.folded_title_ref(s) == ref; });
+        title_prev[id] = NO_SONG;
+        title_next[id] = head ? *head : NO_SONG;
+        if (!head) {
+            title_heads.insert(hash, id);
+            return;
+        }
+        title_prev[*head] = id;
+        *head = id;
+    }
+    void _unlink_title(SongId id) {
+        SongId prev = title_prev[id], next = title_next[id];
+        if (next) title_prev[next] = prev;
+        if (prev) {
+            title_next[prev] = next;
+            return;
+        }
+        uint32_t hash = FlatSongTable::hash_of(store.folded_title(id));
+        if (next) *title_heads.find(hash, [&](SongId s) { return s == id; }) = next;
+        else title_heads.erase(hash, id);
+    }
+
+    // Calls fn(song) for each indexed song whose folded title equals folded.
+    template <typename Fn>
+    void _for_each_titled(const string& folded, bool include_blocked, Fn fn) const {
+        SongId head = title_heads.find(FlatSongTable::hash_of(folded),
+                                       [&](SongId s) { return store.folded_title(s) == folded; });
+        for (SongId id = head; id != NO_SONG; id = title_next[id])
+            if (include_blocked || !store.is_blocked(id)) fn(id);
+    }
+
+    // Documents that may lie within k edits of a query with these padded
+    // trigrams. Such a document lacks at most 3k of them (one edit breaks
+    // at most three), so it appears in at least one of the 3k + 1 shortest
+    // lists and in at least grams - 3k lists overall. Only the short lists
+    // are read; the count is completed by binary search in the long ones.
+    static vector<uint32_t> _fuzzy_candidates(const unordered_map<uint32_t, vector<uint32_t>>& postings,
+                                              const vector<uint32_t>& grams, int k) {
+        vector<uint32_t> candidates;
+        vector<const vector<uint32_t>*> lists;
+        for (uint32_t g : grams) {
+            auto it = postings.find(g);
+            if (it != postings.end()) lists.push_back(&it->second);
+        }
+        size_t missing = grams.size() - lists.size(), short_lists = 3 * (size_t)k + 1;
+        if (missing >= short_lists) return candidates;
+        short_lists -= missing;
+        size_t threshold = grams.size() - 3 * (size_t)k;
+        sort(lists.begin(), lists.end(),
+             [](const vector<uint32_t>* a, const vector<uint32_t>* b) { return a->size() < b->size(); });
+
+        vector<uint32_t> hits;
+        for (size_t i = 0; i < short_lists; ++i) hits.insert(hits.end(), lists[i]->begin(), lists[i]->end());
+        sort(hits.begin(), hits.end());
+        for (size_t i = 0; i < hits.size() && candidates.size() < FUZZY_BUDGET;) {
+            size_t j = i;
+            while (j < hits.size() && hits[j] == hits[i]) ++j;
+            size_t count = j - i;
+            for (size_t l = short_lists; l < lists.size() && count < threshold; ++l) {
+                if (count + (lists.size() - l) < threshold) break;
+                count += binary_search(lists[l]->begin(), lists[l]->end(), hits[i]);
+            }
+            if (count >= threshold) candidates.push_back(hits[i]);
+            i = j;
+        }
+        return candidates;
+    }
+
+    bool _visible(SongId id) const {
+        return id < indexed.size() && indexed[id] && !store.is_blocked(id);
+    }
+
+    bool _title_contains(SongId id, const string& term) const {
+        return id < indexed.size() && indexed[id] && store.folded_title(id).find(term) != string::npos;
+    }
+
+public:
+    explicit SongLookup(const SongStore& s) : store(s) {}
+
+    // Songs that share a title are all kept; adding an indexed song again
+    // is a no-op.
+    void add_song(SongId s) {
+        ScopedMetric timer(metric_lookup_add);
+        if (s < indexed.size() && indexed[s]) return;
+        _index(s);
+    }
+    // Catalog loads: pre-size the tables once, then index in id order so
+    // every posting-list insert is an append.
+    void add_bulk(const vector<SongId>& ids) {
+        ScopedMetric timer(metric_lookup_add_bulk);
+        by_key.reserve(by_key.size() + ids.size());
+        title_heads.reserve(title_heads.size() + ids.size());
+        if (!ids.empty()) {
+            SongId top = *max_element(ids.begin(), ids.end());
+            if (top >= indexed.size()) {
+                indexed.resize(top + 1, 0);
+                title_next.resize(top + 1, NO_SONG);
+                title_prev.resize(top + 1, NO_SONG);
+            }
+        }
+        for (SongId s : ids) add_song(s);
+    }
+
+    void remove_song(SongId s) {
+        ScopedMetric timer(metric_lookup_remove);
+        _unindex(s);
+    }
+
+    // Songs of blocked artists are reported as missing unless
+    // include_blocked is set; the same holds for the searches below.
+    // Where several songs share the title, the oldest (lowest id) wins.
+    SongId get_by_title(StringRef title, bool include_blocked = false) const {
+        ScopedMetric timer(metric_lookup_get);
+        SongId best = NO_SONG;
+        _for_each_titled(fold_case_scratch(title), include_blocked,
+                         [&](SongId id) { if (best == NO_SONG || id < best) best = id; });
+        return best;
+    }
+
+    // Exact (title, artist) lookup: one probe of the composite-key table.
+    SongId get(StringRef title, StringRef artist, bool include_blocked = false) const {
+        ScopedMetric timer(metric_lookup_get);
+        uint32_t artist_key;
+        // Resolve the artist first: both steps fold into the same scratch.
+        if (!store.artist_index().find_key(artist, artist_key)) return NO_SONG;
+        const string& folded_artist = store.artist_index().folded_name_of(artist_key);
+        const string& folded = fold_case_scratch(title);
+        SongId best = NO_SONG;
+        by_key.for_each(FlatSongTable::hash_of(folded, folded_artist), [&](SongId id) {
+            if (store.folded_title(id) != folded || store.artist_key(id) != artist_key) return;
+            if (!include_blocked && store.is_blocked(id)) return;
+            if (best == NO_SONG || id < best) best = id;
+        });
+        return best;
+    }
+
+    // Every song with this title, in id order.
+    vector<SongId> find_all(StringRef title, bool include_blocked = false) const {
+        ScopedMetric timer(metric_lookup_get);
+        vector<SongId> results;
+        _for_each_titled(fold_case_scratch(title), include_blocked,
+                         [&](SongId id) { results.push_back(id); });
+        sort(results.begin(), results.end());
+        return results;
+    }
+
+    // Substring search. Terms of three or more characters intersect the
+    // trigram posting lists (smallest first) and only verify survivors;
+    // shorter terms fall back to a scan. limit == 0 means unlimited.
+    vector<SongId> search_by_partial_title(const string& term, size_t limit = 0) const {
+        ScopedMetric timer(metric_lookup_partial);
+        vector<SongId> results;
+        string t = fold_case(term);
+        if (t.size() < 3) {
+            for (auto& kv : sorted_titles) {
+                if (kv.first->find(t) == string::npos || store.is_blocked(kv.second)) continue;
+                results.push_back(kv.second);
+                if (limit && results.size() >= limit) break;
+            }
+            return results;
+        }
+
+        vector<const vector<SongId>*> lists;
+        for (uint32_t g : trigrams(t)) {
+            auto it = trigram_postings.find(g);
+            if (it == trigram_postings.end()) return results;
+            lists.push_back(&it->second);
+        }
+        sort(lists.begin(), lists.end(),
+             [](const vector<SongId>* a, const vector<SongId>* b) { return a->size() < b->size(); });
+
+        vector<size_t> cursor(lists.size(), 0);
+        for (SongId id : *lists[0]) {
+            bool in_all = true;
+            for (size_t i = 1; i < lists.size() && in_all; ++i) {
+                const vector<SongId>& ids = *lists[i];
+                cursor[i] = lower_bound(ids.begin() + cursor[i], ids.end(), id) - ids.begin();
+                in_all = cursor[i] < ids.size() && ids[cursor[i]] == id;
+            }
+            if (!in_all || store.is_blocked(id) || !_title_contains(id, t)) continue;
+            results.push_back(id);
+            if (limit && results.size() >= limit) break;
+        }
+        return results;
+    }
+
+    // Typo-tolerant search over titles and, if include_artists is set,
+    // artist names (an artist match lists that artist's songs). Results
+    // are ranked by edit distance, title matches first, then by id.
+    // Candidates come from the padded-trigram postings and are verified
+    // with a bit-parallel edit distance; at most FUZZY_BUDGET of each kind
+    // are verified, which bounds the cost on any catalog size.
+    // max_distance is lowered for queries too short to support it.
+    vector<FuzzyMatch> fuzzy_search(StringRef query, int max_distance, bool include_artists,
+                                    size_t limit = 10) const {
+        ScopedMetric timer(metric_lookup_fuzzy);
+        vector<FuzzyMatch> results;
+        string q;
+        fold_case_append(query.data, query.size, q);
+        vector<uint32_t> grams = padded_trigrams(q);
+        int k = min(max_distance, (int)(grams.size() - 1) / 3);
+        if (q.empty() || k < 0) return results;
+
+        EditDistancePattern pattern(q);
+        for (SongId id : _fuzzy_candidates(fuzzy_title_postings, grams, k)) {
+            if (!_visible(id)) continue;
+            int d = pattern.distance(store.folded_title(id), k);
+            if (d <= k) results.push_back(FuzzyMatch{id, d, false});
+        }
+        if (include_artists) {
+            for (uint32_t artist : _fuzzy_candidates(fuzzy_artist_postings, grams, k)) {
+                if (store.artist_index().is_blocked_key(artist)) continue;
+                int d = pattern.distance(fold_case(store.artist_index().name_of(artist)), k);
+                if (d > k) continue;
+                for (SongId id : store.artist_index().songs_of(artist))
+                    if (_visible(id)) results.push_back(FuzzyMatch{id, d, true});
+            }
+        }
+
+        sort(results.begin(), results.end(), [](const FuzzyMatch& a, const FuzzyMatch& b) {
+            if (a.distance != b.distance) return a.distance < b.distance;
+            if (a.by_artist != b.by_artist) return !a.by_artist;
+            return a.song < b.song;
+        });
+        // A song can match by title and by artist; keep its best entry.
+        unordered_set<SongId> seen;
+        size_t kept = 0;
+        for (const FuzzyMatch& m : results) {
+            if (!seen.insert(m.song).second) continue;
+            results[kept++] = m;
+            if (limit && kept >= limit) break;
+        }
+        results.resize(kept);
+        return results;
+    }
+
+    // Titles starting with prefix, in title order.
+    vector<SongId> search_by_prefix(const string& prefix, size_t limit = 0) const {
+        ScopedMetric timer(metric_lookup_prefix);
+        vector<SongId> results;
+        const string& p = fold_case_scratch(prefix);
+        for (auto it = sorted_titles.lower_bound(p); it != sorted_titles.end(); ++it) {
+            if (it->first->compare(0, p.size(), p) != 0) break;
+            if (store.is_blocked(it->second)) continue;
+            results.push_back(it->second);
+            if (limit && results.size() >= limit) break;
+        }
+        return results;
+    }
+};
+
+// ================= Playback History (Ring Buffer) =================
+struct PlayEvent {
+    SongId song;
+    long long played_at_ms; // wall clock, milliseconds since epoch
+};
+
+static long long now_ms() {
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Streaming "hot right now" counter for one window: a play's weight
+// halves every window. Plays go into a count-min sketch (DEPTH rows of
+// 2^WIDTH_BITS counters, conservative update) and the TOP_K songs with the
+// highest estimates are kept beside it, so memory is fixed however many
+// songs are played. Decay is forward decay, as in CoPlayModel below; an
+// update is DEPTH counter bumps plus a scan of TOP_K entries.
+class DecayedTopK {
+public:
+    static const size_t DEPTH = 4;
+    static const size_t WIDTH_BITS = 12;
+    static const size_t TOP_K = 32;
+
+    struct Entry {
+        SongId song;
+        float weight; // forward-decayed; see top() for plain play counts
+    };
+
+private:
+    long long window_ms;
+    long long landmark_ms;
+    vector<float> counters; // DEPTH rows, row-major
+    vector<Entry> heavy;    // at most TOP_K
+
+    static size_t _slot(size_t row, SongId song) {
+        static const uint64_t MULTIPLIERS[DEPTH] = {
+            0x9E3779B97F4A7C15ULL, 0xBF58476D1CE4E5B9ULL, 0x94D049BB133111EBULL, 0xD6E8FEB86659FD93ULL};
+        uint64_t h = ((uint64_t)song + row) * MULTIPLIERS[row];
+        return (row << WIDTH_BITS) | (size_t)(h >> (64 - WIDTH_BITS));
+    }
+
+    double _scale(long long at_ms) const {
+        return exp2((double)(at_ms - landmark_ms) / window_ms);
+    }
+
+    void _rescale(long long new_landmark_ms) {
+        float factor = (float)exp2((double)(landmark_ms - new_landmark_ms) / window_ms);
+        for (float& c : counters) c *= factor;
+        for (Entry& e : heavy) e.weight *= factor;
+        landmark_ms = new_landmark_ms;
+    }
+
+public:
+    explicit DecayedTopK(long long window)
+        : window_ms(max(window, 1LL)), landmark_ms(LLONG_MIN), counters(DEPTH << WIDTH_BITS, 0.0f) {}
+
+    void add(SongId song, long long at_ms) {
+        if (landmark_ms == LLONG_MIN) landmark_ms = at_ms;
+        if (at_ms - landmark_ms > 32 * window_ms) _rescale(at_ms);
+        float inc = (float)_scale(at_ms);
+        float estimate = counters[_slot(0, song)];
+        for (size_t row = 1; row < DEPTH; ++row) estimate = min(estimate, counters[_slot(row, song)]);
+        estimate += inc;
+        // Conservative update: raise only the counters below the new estimate.
+        for (size_t row = 0; row < DEPTH; ++row) {
+            float& c = counters[_slot(row, song)];
+            c = max(c, estimate);
+        }
+
+        size_t lightest = 0;
+        for (size_t i = 0; i < heavy.size(); ++i) {
+            if (heavy[i].song == song) { heavy[i].weight = estimate; return; }
+            if (heavy[i].weight < heavy[lightest].weight) lightest = i;
+        }
+        if (heavy.size() < TOP_K) heavy.push_back(Entry{song, estimate});
+        else if (estimate > heavy[lightest].weight) heavy[lightest] = Entry{song, estimate};
+    }
+
+    // Tracked songs by decayed play count at at_ms, highest first.
+    vector<pair<SongId, double>> top(long long at_ms) const {
+        vector<pair<SongId, double>> out;
+        double scale = landmark_ms == LLONG_MIN ? 1.0 : _scale(at_ms);
+        for (const Entry& e : heavy) out.emplace_back(e.song, e.weight / scale);
+        sort(out.begin(), out.end(), [](const pair<SongId, double>& a, const pair<SongId, double>& b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+        return out;
+    }
+
+    long long window() const { return window_ms; }
+};
+
+// Sparse "played next" graph over canonical song ids: each song keeps at
+// most MAX_NEIGHBORS weighted successors. Weights decay with a half-life
+// via forward decay: a play at time t adds 2^((t - landmark) / half-life),
+// so old edges never need touching; all weights are rescaled (amortized
+// O(1)) once the increment grows large. A full neighbor list replaces its
+// lightest edge and inherits that weight (space-saving), so frequent
+// successors are never evicted by a stream of one-offs.
+class CoPlayModel {
+public:
+    static const size_t MAX_NEIGHBORS = 16;
+    static const long long HALF_LIFE_MS = 14LL * 24 * 3600 * 1000;
+    static const long long SESSION_GAP_MS = 30LL * 60 * 1000; // longer pauses start a new session
+
+    struct Edge {
+        SongId song;
+        float weight;
+    };
+
+private:
+    vector<vector<Edge>> next_by_song;
+    long long landmark_ms;
+    size_t edge_count;
+
+    double _increment(long long at_ms) const {
+        return exp2((double)(at_ms - landmark_ms) / HALF_LIFE_MS);
+    }
+
+    void _rescale(long long new_landmark_ms) {
+        float factor = (float)exp2((double)(landmark_ms - new_landmark_ms) / HALF_LIFE_MS);
+        for (auto& edges : next_by_song)
+            for (Edge& e : edges) e.weight *= factor;
+        landmark_ms = new_landmark_ms;
+    }
+
+public:
+    CoPlayModel() : landmark_ms(LLONG_MIN), edge_count(0) {}
+
+    // Counts `to` played right after `from`; plays more than
+    // SESSION_GAP_MS apart and repeats are not linked.
+    void record(SongId from, long long from_ms, SongId to, long long to_ms) {
+        if (from == to || from == NO_SONG || to == NO_SONG || to_ms - from_ms > SESSION_GAP_MS) return;
+        if (landmark_ms == LLONG_MIN) landmark_ms = to_ms;
+        if (to_ms - landmark_ms > 32 * HALF_LIFE_MS) _rescale(to_ms);
+        float inc = (float)_increment(to_ms);
+        if (from >= next_by_song.size()) next_by_song.resize(max<size_t>(from + 1, next_by_song.size() * 2));
+        vector<Edge>& edges = next_by_song[from];
+        size_t lightest = 0;
+        for (size_t i = 0; i < edges.size(); ++i) {
+            if (edges[i].song == to) { edges[i].weight += inc; return; }
+            if (edges[i].weight < edges[lightest].weight) lightest = i;
+        }
+        if (edges.size() < MAX_NEIGHBORS) {
+            edges.push_back(Edge{to, inc});
+            edge_count++;
+        } else {
+            edges[lightest] = Edge{to, edges[lightest].weight + inc};
+        }
+    }
+
+    const vector<Edge>& successors(SongId from) const {
+        static const vector<Edge> none;
+        return from < next_by_song.size() ? next_by_song[from] : none;
+    }
+
+    // Snapshot support: edges are saved relative to the landmark.
+    long long landmark() const { return landmark_ms; }
+    size_t edges() const { return edge_count; }
+    template <typename Fn>
+    void for_each_edge(Fn fn) const {
+        for (SongId from = 0; from < next_by_song.size(); ++from)
+            for (const Edge& e : next_by_song[from]) fn(from, e.song, e.weight);
+    }
+    void restore_landmark(long long ms) { landmark_ms = ms; }
+    void restore_edge(SongId from, SongId to, float weight) {
+        if (from >= next_by_song.size()) next_by_song.resize(from + 1);
+        if (next_by_song[from].size() >= MAX_NEIGHBORS) return;
+        next_by_song[from].push_back(Edge{to, weight});
+        edge_count++;
+    }
+};
+
+// Fixed-capacity circular history. Once full, the oldest play is evicted
+// (and appended to the spill file, if one was given) to make room.
+class PlaybackHistory {
+    const SongStore& store;
+    vector<PlayEvent> ring;
+    size_t head;  // slot the next play is written to
+    size_t count;
+    string spill_path;
+    ofstream spill;
+    CoPlayModel coplay;
+    vector<DecayedTopK> trending; // one per window
+
+    const PlayEvent& _nth_newest(size_t i) const {
+        return ring[(head + ring.size() - 1 - i) % ring.size()];
+    }
+
+    void _spill(const PlayEvent& e) {
+        if (spill_path.empty()) return;
+        if (!spill.is_open()) spill.open(spill_path, ios::app);
+        spill << e.played_at_ms << '\t' << e.song << '\t'
+              << store.title(e.song) << '\t' << store.artist(e.song) << '\n';
+    }
+
+public:
+    // Iterates the n most recent plays, newest first, by reference.
+    class RecentView {
+        const PlaybackHistory& history;
+        size_t n;
+    public:
+        class iterator {
+            const PlaybackHistory* h;
+            size_t i;
+        public:
+            iterator(const PlaybackHistory* hist, size_t idx) : h(hist), i(idx) {}
+            const PlayEvent& operator*() const { return h->_nth_newest(i); }
+            const PlayEvent* operator->() const { return &h->_nth_newest(i); }
+            iterator& operator++() { ++i; return *this; }
+            bool operator!=(const iterator& other) const { return i != other.i; }
+        };
+        RecentView(const PlaybackHistory& h, size_t count) : history(h), n(count) {}
+        iterator begin() const { return iterator(&history, 0); }
+        iterator end() const { return iterator(&history, n); }
+        size_t size() const { return n; }
+    };
+
+    explicit PlaybackHistory(const SongStore& s, size_t capacity = 1024,
+                             const string& spill_file = "")
+        : store(s), ring(max<size_t>(capacity, 1)), head(0), count(0), spill_path(spill_file) {
+        set_trending_windows({3600LL * 1000, 24LL * 3600 * 1000});
+    }
+
+    // Replaces the trending windows and drops their counts; meant for
+    // startup, before any play is recorded.
+    void set_trending_windows(const vector<long long>& windows_ms) {
+        trending.clear();
+        for (long long w : windows_ms) trending.emplace_back(w);
+    }
+    const vector<DecayedTopK>& trending_windows() const { return trending; }
+
+    void play(SongId song) { play(song, now_ms()); }
+
+    // Records a play and links it to the previous one in the co-play model.
+    void play(SongId song, long long played_at_ms) {
+        ScopedMetric timer(metric_history_play);
+        if (count > 0) {
+            const PlayEvent& prev = _nth_newest(0);
+            coplay.record(store.canonical(prev.song), prev.played_at_ms,
+                          store.canonical(song), played_at_ms);
+        }
+        restore_play(song, played_at_ms);
+    }
+
+    // Appends a play without touching the co-play model (snapshot loads,
+    // where the model is restored separately). Trending is not saved, so
+    // the restored plays rebuild it.
+    void restore_play(SongId song, long long played_at_ms) {
+        for (DecayedTopK& w : trending) w.add(store.canonical(song), played_at_ms);
+        if (count == ring.size()) _spill(ring[head]);
+        else count++;
+        ring[head].song = song;
+        ring[head].played_at_ms = played_at_ms;
+        head = (head + 1) % ring.size();
+    }
+
+    SongId undo_last_play() {
+        ScopedMetric timer(metric_history_undo);
+        if (count == 0) return NO_SONG;
+        head = (head + ring.size() - 1) % ring.size();
+        count--;
+        return ring[head].song;
+    }
+
+    RecentView recent(size_t n) const { return RecentView(*this, min(n, count)); }
+
+    // Number of retained plays at or after since_ms (timestamps are
+    // non-decreasing, so this is a binary search over the ring).
+    size_t plays_since(long long since_ms) const {
+        size_t lo = 0, hi = count;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (_nth_newest(mid).played_at_ms >= since_ms) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    size_t size() const { return count; }
+    size_t capacity() const { return ring.size(); }
+
+    const CoPlayModel& coplay_model() const { return coplay; }
+    CoPlayModel& coplay_model() { return coplay; }
+};
+
+struct Recommendation {
+    SongId song;
+    double score;
+};
+
+// Candidates to play next: successors of the last three plays (weighted 1,
+// 1/2 and 1/4), without the current song, in no particular order. Reads at
+// most 3 * MAX_NEIGHBORS edges, whatever the catalog size.
+vector<Recommendation> score_next(const PlaybackHistory& history, const SongStore& store) {
+    ScopedMetric timer(metric_history_recommend);
+    vector<SongId> seeds;
+    for (auto& e : history.recent(8)) {
+        SongId s = store.canonical(e.song);
+        if (find(seeds.begin(), seeds.end(), s) == seeds.end()) seeds.push_back(s);
+        if (seeds.size() == 3) break;
+    }
+    vector<Recommendation> scored;
+    double factor = 1.0;
+    for (SongId seed : seeds) {
+        for (const CoPlayModel::Edge& e : history.coplay_model().successors(seed)) {
+            auto it = find_if(scored.begin(), scored.end(), [&](const Recommendation& r) { return r.song == e.song; });
+            if (it != scored.end()) it->score += e.weight * factor;
+            else scored.push_back(Recommendation{e.song, e.weight * factor});
+        }
+        factor /= 2;
+    }
+    if (!seeds.empty())
+        scored.erase(remove_if(scored.begin(), scored.end(),
+                               [&](const Recommendation& r) { return r.song == seeds[0]; }),
+                     scored.end());
+    return scored;
+}
+
+// The n best of score_next's candidates, skipping blocked artists, songs
+// rated 1 or 2, and anything `skip` rejects. Rated songs are scaled by
+// rating / 3.
+template <typename Skip>
+vector<Recommendation> pick_next(vector<Recommendation> scored, const SongStore& store,
+                                 size_t n, Skip skip) {
+    size_t kept = 0;
+    for (const Recommendation& r : scored) {
+        int rating = store.rating(r.song);
+        if (store.is_blocked(r.song) || (rating > 0 && rating < 3) || skip(r.song))
+            continue;
+        scored[kept] = r;
+        if (rating > 0) scored[kept].score *= rating / 3.0;
+        kept++;
+    }
+    scored.resize(kept);
+    sort(scored.begin(), scored.end(), [](const Recommendation& a, const Recommendation& b) {
+        return a.score != b.score ? a.score > b.score : a.song < b.song;
+    });
+    if (scored.size() > n) scored.resize(n);
+    return scored;
+}
+
+template <typename Skip>
+vector<Recommendation> recommend_next(const PlaybackHistory& history, const SongStore& store,
+                                      size_t n, Skip skip) {
+    return pick_next(score_next(history, store), store, n, skip);
+}
+
+// ================= Song Rating Tree (AVL) =================
+// Height-balanced BST keyed by rating. Each node keeps its songs in a list
+// and every rated song has a handle (node + list position), so re-rating or
+// deleting a song never searches other nodes. Per-rating counts and the
+// rating sum are maintained on every change. Handles are indexed by SongId.
+struct RatingNode {
+    int rating;
+    list<SongId> songs;
+    int height;
+    RatingNode* left;
+    RatingNode* right;
+    RatingNode(int r) : rating(r), height(1), left(nullptr), right(nullptr) {}
+};
+
+struct RatingHandle {
+    RatingNode* node;
+    list<SongId>::iterator pos;
+};
+
+struct RatingSummary {
+    map<int, int> counts; // rating -> songs
+    size_t rated;
+    double average;       // 0 when nothing is rated
+};
+
+class SongRatingBST {
+    SongStore& store;
+    RatingNode* root;
+    vector<RatingHandle> handles; // node == nullptr: song not rated
+    size_t rated;
+    map<int,int> counts;
+    long long rating_sum;
+
+    static int _height(RatingNode* node) { return node ? node->height : 0; }
+
+    static void _update(RatingNode* node) {
+        node->height = 1 + max(_height(node->left), _height(node->right));
+    }
+
+    static RatingNode* _rotate_right(RatingNode* node) {
+        RatingNode* l = node->left;
+        node->left = l->right;
+        l->right = node;
+        _update(node); _update(l);
+        return l;
+    }
+
+    static RatingNode* _rotate_left(RatingNode* node) {
+        RatingNode* r = node->right;
+        node->right = r->left;
+        r->left = node;
+        _update(node); _update(r);
+        return r;
+    }
+
+    static RatingNode* _rebalance(RatingNode* node) {
+        _update(node);
+        int balance = _height(node->left) - _height(node->right);
+        if (balance > 1) {
+            if (_height(node->left->left) < _height(node->left->right))
+                node->left = _rotate_left(node->left);
+            return _rotate_right(node);
+        }
+        if (balance < -1) {
+            if (_height(node->right->right) < _height(node->right->left))
+                node->right = _rotate_right(node->right);
+            return _rotate_left(node);
+        }
+        return node;
+    }
+
+    // Returns the (possibly new) subtree root; found receives the node for r.
+    static RatingNode* _insert(RatingNode* node, int r, RatingNode*& found) {
+        if (!node) return found = new RatingNode(r);
+        if (r < node->rating) node->left = _insert(node->left, r, found);
+        else if (r > node->rating) node->right = _insert(node->right, r, found);
+        else { found = node; return node; }
+        return _rebalance(node);
+    }
+
+    RatingNode* _erase(RatingNode* node, int r) {
+        if (!node) return nullptr;
+        if (r < node->rating) node->left = _erase(node->left, r);
+        else if (r > node->rating) node->right = _erase(node->right, r);
+        else {
+            if (!node->left || !node->right) {
+                RatingNode* child = node->left ? node->left : node->right;
+                delete node;
+                return child;
+            }
+            // Steal the in-order successor's songs; handles point at nodes,
+            // so re-home them before the successor is unlinked.
+            RatingNode* succ = node->right;
+            while (succ->left) succ = succ->left;
+            node->rating = succ->rating;
+            node->songs.swap(succ->songs);
+            for (SongId s : node->songs) handles[s].node = node;
+            node->right = _erase(node->right, succ->rating);
+        }
+        return _rebalance(node);
+    }
+
+    void _remove_handle(SongId song) {
+        if (song >= handles.size() || !handles[song].node) return;
+        RatingNode* node = handles[song].node;
+        int r = node->rating;
+        node->songs.erase(handles[song].pos);
+        handles[song].node = nullptr;
+        rated--;
+        if (--counts[r] == 0) counts.erase(r);
+        rating_sum -= r;
+        if (node->songs.empty()) root = _erase(root, r);
+    }
+
+    // Walks ratings from high to low, skipping whole nodes while offset remains.
+    void _collect_desc(RatingNode* node, int lo, int hi, size_t& offset,
+                       size_t limit, vector<SongId>& out) const {
+        if (!node || (limit && out.size() >= limit)) return;
+        if (node->rating < hi) _collect_desc(node->right, lo, hi, offset, limit, out);
+        if (node->rating >= lo && node->rating <= hi) {
+            if (offset >= node->songs.size()) offset -= node->songs.size();
+            else {
+                auto s = node->songs.begin();
+                advance(s, offset);
+                offset = 0;
+                for (; s != node->songs.end() && !(limit && out.size() >= limit); ++s)
+                    out.push_back(*s);
+            }
+        }
+        if (node->rating > lo) _collect_desc(node->left, lo, hi, offset, limit, out);
+    }
+
+    static void _free(RatingNode* node) {
+        if (!node) return;
+        _free(node->left); _free(node->right); delete node;
+    }
+
+public:
+    explicit SongRatingBST(SongStore& s) : store(s), root(nullptr), rated(0), rating_sum(0) {}
+    ~SongRatingBST() { _free(root); }
+    SongRatingBST(const SongRatingBST&) = delete;
+    SongRatingBST& operator=(const SongRatingBST&) = delete;
+
+    void insert_or_update(SongId song, int r) {
+        ScopedMetric timer(metric_ratings_update);
+        _remove_handle(song);
+        store.set_rating(song, r);
+        RatingNode* node = nullptr;
+        root = _insert(root, r, node);
+        node->songs.push_back(song);
+        if (song >= handles.size()) handles.resize(max<size_t>(song + 1, handles.size() * 2));
+        handles[song] = {node, prev(node->songs.end())};
+        rated++;
+        counts[r]++;
+        rating_sum += r;
+    }
+    void delete_song(SongId song) {
+        ScopedMetric timer(metric_ratings_delete);
+        _remove_handle(song);
+    }
+    bool contains(SongId song) const { return song < handles.size() && handles[song].node; }
+
+    // Indexes every listed song that already carries a rating in the store.
+    void add_bulk(const vector<SongId>& ids) {
+        if (!ids.empty()) {
+            SongId top = *max_element(ids.begin(), ids.end());
+            if (top >= handles.size()) handles.resize(top + 1);
+        }
+        for (SongId s : ids)
+            if (store.rating(s) > 0) insert_or_update(s, store.rating(s));
+    }
+    // Counts and average without songs of blocked artists, which every
+    // other view hides. Blocked artists are few, so their rated songs are
+    // subtracted from the running totals rather than walking the tree.
+    RatingSummary visible_summary() const {
+        RatingSummary out = {counts, rated, 0.0};
+        long long sum = rating_sum;
+        store.artist_index().for_each_blocked_song([&](SongId s) {
+            if (s >= handles.size() || !handles[s].node) return;
+            int r = handles[s].node->rating;
+            if (--out.counts[r] == 0) out.counts.erase(r);
+            out.rated--;
+            sum -= r;
+        });
+        if (out.rated) out.average = (double)sum / out.rated;
+        return out;
+    }
+
+    // Songs rated within [min_rating, max_rating], highest rating first,
+    // paginated by offset/limit (limit == 0 means no limit).
+    vector<SongId> songs_in_range(int min_rating, int max_rating,
+                                  size_t offset = 0, size_t limit = 0) const {
+        ScopedMetric timer(metric_ratings_range);
+        vector<SongId> out;
+        _collect_desc(root, min_rating, max_rating, offset, limit, out);
+        return out;
+    }
+};
+
+// ================= Favorites (Indexed Max Heap) =================
+struct HeapItem {
+    int listen_time;
+    SongId song;
+    bool operator<(const HeapItem& other) const {
+        return listen_time < other.listen_time;
+    }
+};
+
+// Binary max-heap with a SongId -> slot map, so every song occupies exactly
+// one slot: plays are an in-place increase-key and deletes remove the slot.
+class FavoriteQueue {
+    static const size_t NO_SLOT = (size_t)-1;
+    const SongStore& store;
+    vector<HeapItem> heap;
+    vector<size_t> position; // indexed by SongId
+
+    void _place(size_t i, HeapItem item) {
+        position[item.song] = i;
+        heap[i] = std::move(item);
+    }
+
+    void _sift_up(size_t i) {
+        HeapItem item = std::move(heap[i]);
+        while (i > 0) {
+            size_t parent = (i - 1) / 2;
+            if (!(heap[parent] < item)) break;
+            _place(i, std::move(heap[parent]));
+            i = parent;
+        }
+        _place(i, std::move(item));
+    }
+
+    void _sift_down(size_t i) {
+        HeapItem item = std::move(heap[i]);
+        size_t n = heap.size();
+        while (true) {
+            size_t child = 2 * i + 1;
+            if (child >= n) break;
+            if (child + 1 < n && heap[child] < heap[child + 1]) child++;
+            if (!(item < heap[child])) break;
+            _place(i, std::move(heap[child]));
+            i = child;
+        }
+        _place(i, std::move(item));
+    }
+
+public:
+    explicit FavoriteQueue(const SongStore& s) : store(s) {}
+
+    // Songs of blocked artists are never ranked.
+    void add_or_update(SongId s) {
+        ScopedMetric timer(metric_favorites_update);
+        if (store.is_blocked(s)) return;
+        int listen_time = store.listen_time(s);
+        if (s >= position.size()) position.resize(max<size_t>(s + 1, position.size() * 2), (size_t)NO_SLOT);
+        if (position[s] == NO_SLOT) {
+            heap.push_back({listen_time, s});
+            _sift_up(heap.size() - 1);
+            return;
+        }
+        size_t i = position[s];
+        int old_time = heap[i].listen_time;
+        heap[i].listen_time = listen_time;
+        if (listen_time > old_time) _sift_up(i);
+        else _sift_down(i);
+    }
+
+    void remove(SongId song) {
+        ScopedMetric timer(metric_favorites_remove);
+        if (song >= position.size() || position[song] == NO_SLOT) return;
+        size_t i = position[song];
+        position[song] = NO_SLOT;
+        HeapItem last = std::move(heap.back());
+        heap.pop_back();
+        if (i == heap.size()) return;
+        _place(i, std::move(last));
+        if (i > 0 && heap[(i - 1) / 2] < heap[i]) _sift_up(i);
+        else _sift_down(i);
+    }
+
+    size_t size() const { return heap.size(); }
+
+    vector<SongId> songs() const {
+        vector<SongId> out;
+        out.reserve(heap.size());
+        for (auto& item : heap) out.push_back(item.song);
+        return out;
+    }
+
+    // Best-first walk over the heap array: a small frontier heap of slot
+    // indices yields the k largest in order without touching the heap itself.
+    vector<HeapItem> get_top_items(int k) const {
+        ScopedMetric timer(metric_favorites_top);
+        vector<HeapItem> out;
+        if (heap.empty() || k <= 0) return out;
+        auto cmp = [this](size_t a, size_t b) { return heap[a] < heap[b]; };
+        priority_queue<size_t, vector<size_t>, decltype(cmp)> frontier(cmp);
+        frontier.push(0);
+        while (!frontier.empty() && (int)out.size() < k) {
+            size_t i = frontier.top(); frontier.pop();
+            out.push_back(heap[i]);
+            if (2 * i + 1 < heap.size()) frontier.push(2 * i + 1);
+            if (2 * i + 2 < heap.size()) frontier.push(2 * i + 2);
+        }
+        return out;
+    }
+
+    vector<SongId> get_top_favorites(int k = 5) const {
+        vector<SongId> out;
+        for (auto& item : get_top_items(k)) out.push_back(item.song);
+        return out;
+    }
+};
+
+// ================= Play Ingestion (Lock-free Queue + Batch Consumer) =================
+struct PlayEventIn {
+    SongId song;
+    int seconds;             // listened time credited to the song
+    long long played_at_ms;
+};
+
+// Bounded lock-free multi-producer queue (Vyukov): every slot carries a
+// sequence number that tells producers and the consumer whose turn it is,
+// so a push or pop is one CAS on the shared cursor plus one release store.
+template <typename T>
+class BoundedMpmcQueue {
+    struct Slot {
+        atomic<size_t> seq;
+        T value;
+    };
+    unique_ptr<Slot[]> slots;
+    size_t mask;
+    alignas(64) atomic<size_t> enqueue_pos;
+    alignas(64) atomic<size_t> dequeue_pos;
+
+public:
+    explicit BoundedMpmcQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        slots.reset(new Slot[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; ++i) slots[i].seq.store(i, memory_order_relaxed);
+        enqueue_pos.store(0, memory_order_relaxed);
+        dequeue_pos.store(0, memory_order_relaxed);
+    }
+
+    bool try_push(const T& value) {
+        size_t pos = enqueue_pos.load(memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots[pos & mask];
+            size_t seq = slot.seq.load(memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    slot.value = value;
+                    slot.seq.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // full
+            } else {
+                pos = enqueue_pos.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(T& out) {
+        size_t pos = dequeue_pos.load(memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots[pos & mask];
+            size_t seq = slot.seq.load(memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    out = slot.value;
+                    slot.seq.store(pos + mask + 1, memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // empty
+            } else {
+                pos = dequeue_pos.load(memory_order_relaxed);
+            }
+        }
+    }
+};
+
+// Global play / listen-second totals, striped over cache-line-sized shards
+// so concurrent producers do not contend on one counter.
+class ShardedListenCounters {
+    static const size_t SHARDS = 16;
+    struct alignas(64) Shard {
+        atomic<uint64_t> plays;
+        atomic<uint64_t> seconds;
+    };
+    Shard shards[SHARDS];
+
+    static size_t _shard() {
+        static thread_local size_t idx = hash<thread::id>()(this_thread::get_id()) % SHARDS;
+        return idx;
+    }
+
+public:
+    ShardedListenCounters() {
+        for (auto& s : shards) { s.plays.store(0); s.seconds.store(0); }
+    }
+    void add(int seconds) {
+        Shard& s = shards[_shard()];
+        s.plays.fetch_add(1, memory_order_relaxed);
+        s.seconds.fetch_add((uint64_t)max(seconds, 0), memory_order_relaxed);
+    }
+    uint64_t plays() const {
+        uint64_t total = 0;
+        for (auto& s : shards) total += s.plays.load(memory_order_relaxed);
+        return total;
+    }
+    uint64_t seconds() const {
+        uint64_t total = 0;
+        for (auto& s : shards) total += s.seconds.load(memory_order_relaxed);
+        return total;
+    }
+};
+
+// Any number of listener sessions submit plays; one consumer thread drains
+// the queue in batches and applies them to the store's listen times,
+// PlaybackHistory and FavoriteQueue while holding state_mutex(). Other code
+// that touches those structures (or grows the store) must hold it too.
+// After every batch the consumer publishes an immutable PlayViews that
+// readers load without taking any lock.
+struct TrendingView {
+    long long window_ms;
+    size_t plays;                     // plays in the last window at published_at_ms
+    vector<pair<SongId, double>> top; // decayed play counts at published_at_ms
+};
+
+struct PlayViews {
+    long long published_at_ms;
+    vector<HeapItem> top_favorites;
+    vector<PlayEvent> recent_plays;  // newest first
+    vector<TrendingView> trending;
+    vector<Recommendation> next;     // score_next() candidates, unfiltered
+};
+
+class PlayIngestion {
+    static const size_t BATCH = 4096;
+    static const int TOP_K = 10;
+    static const size_t RECENT_N = 10;
+
+    SongStore& store;
+    PlaybackHistory& history;
+    FavoriteQueue& favorites;
+    BoundedMpmcQueue<PlayEventIn> queue;
+    ShardedListenCounters counters;
+    mutex state_mu;
+    mutex wake_mu;
+    condition_variable wake_cv;
+    condition_variable applied_cv;
+    atomic<uint64_t> submitted;
+    atomic<uint64_t> applied;
+    atomic<bool> consumer_idle;
+    atomic<bool> stopping;
+    shared_ptr<const PlayViews> views_snapshot;
+    thread consumer;
+
+    // Caller holds state_mu.
+    void _publish_locked() {
+        auto views = make_shared<PlayViews>();
+        long long now = now_ms();
+        views->published_at_ms = now;
+        views->top_favorites = favorites.get_top_items(TOP_K);
+        for (auto& e : history.recent(RECENT_N)) views->recent_plays.push_back(e);
+        for (const DecayedTopK& w : history.trending_windows())
+            views->trending.push_back(TrendingView{w.window(), history.plays_since(now - w.window()), w.top(now)});
+        views->next = score_next(history, store);
+        atomic_store(&views_snapshot, shared_ptr<const PlayViews>(std::move(views)));
+    }
+
+    void _apply(vector<PlayEventIn>& batch) {
+        ScopedMetric timer(metric_ingest_batch);
+        vector<SongId> touched;
+        touched.reserve(batch.size());
+        {
+            lock_guard<mutex> lock(state_mu);
+            for (auto& e : batch) {
+                if (!store.valid(e.song)) continue;
+                store.add_listen_time(e.song, e.seconds);
+                history.play(e.song, e.played_at_ms);
+                touched.push_back(e.song);
+            }
+            sort(touched.begin(), touched.end());
+            touched.erase(unique(touched.begin(), touched.end()), touched.end());
+            for (SongId s : touched) favorites.add_or_update(s);
+            _publish_locked();
+        }
+        {
+            lock_guard<mutex> lock(wake_mu);
+            applied.fetch_add(batch.size());
+        }
+        applied_cv.notify_all();
+        batch.clear();
+    }
+
+    void _run() {
+        SubsystemScope scope(SUB_INGEST);
+        vector<PlayEventIn> batch;
+        batch.reserve(BATCH);
+        while (true) {
+            PlayEventIn e;
+            while (batch.size() < BATCH && queue.try_pop(e)) batch.push_back(e);
+            if (!batch.empty()) { _apply(batch); continue; }
+            if (stopping.load()) return;
+            unique_lock<mutex> lock(wake_mu);
+            consumer_idle.store(true);
+            wake_cv.wait_for(lock, chrono::milliseconds(5), [this] {
+                return stopping.load() || submitted.load() > applied.load();
+            });
+            consumer_idle.store(false);
+        }
+    }
+
+public:
+    PlayIngestion(SongStore& s, PlaybackHistory& h, FavoriteQueue& f, size_t queue_capacity = 1 << 16)
+        : store(s), history(h), favorites(f), queue(queue_capacity),
+          submitted(0), applied(0), consumer_idle(false), stopping(false) {
+        republish();
+        consumer = thread(&PlayIngestion::_run, this);
+    }
+    ~PlayIngestion() {
+        stopping.store(true);
+        {
+            lock_guard<mutex> lock(wake_mu);
+        }
+        wake_cv.notify_all();
+        consumer.join();
+    }
+    PlayIngestion(const PlayIngestion&) = delete;
+    PlayIngestion& operator=(const PlayIngestion&) = delete;
+
+    // Thread-safe; spins (yielding) only while the queue is full.
+    void submit(SongId song, int seconds, long long played_at_ms) {
+        PlayEventIn e = {song, seconds, played_at_ms};
+        while (!queue.try_push(e)) {
+            wake_cv.notify_one();
+            this_thread::yield();
+        }
+        counters.add(seconds);
+        submitted.fetch_add(1);
+        if (consumer_idle.load()) {
+            lock_guard<mutex> lock(wake_mu);
+            wake_cv.notify_one();
+        }
+    }
+
+    // Waits until every play submitted before the call has been applied.
+    void flush() {
+        uint64_t target = submitted.load();
+        unique_lock<mutex> lock(wake_mu);
+        wake_cv.notify_one();
+        applied_cv.wait(lock, [&] { return applied.load() >= target; });
+    }
+
+    mutex& state_mutex() { return state_mu; }
+
+    // Re-publishes the read snapshots after a direct change to history or
+    // favorites (delete, undo, restore). Takes state_mutex() itself.
+    void republish() {
+        lock_guard<mutex> lock(state_mu);
+        _publish_locked();
+    }
+
+    shared_ptr<const PlayViews> views() const { return atomic_load(&views_snapshot); }
+    uint64_t total_plays() const { return counters.plays(); }
+    uint64_t total_listen_seconds() const { return counters.seconds(); }
+};
+
+// ================= Sort Engine (Keyed Introsort) =================
+// Sort keys are extracted once into a flat vector; the sort then runs in
+// place over those records with an inlined comparator, and the id vector is
+// rewritten once at the end.
+struct SongSortKey {
+    const string* title;
+    const string* artist;
+    int duration;
+    SongId song;
+    uint32_t index; // position before sorting; final tie-break keeps it stable
+};
+
+struct ByTitle {
+    bool operator()(const SongSortKey& a, const SongSortKey& b) const { return *a.title < *b.title; }
+};
+struct ByArtist {
+    bool operator()(const SongSortKey& a, const SongSortKey& b) const { return *a.artist < *b.artist; }
+};
+struct ByDuration {
+    bool operator()(const SongSortKey& a, const SongSortKey& b) const { return a.duration < b.duration; }
+};
+struct ByRecentlyAdded {
+    bool operator()(const SongSortKey& a, const SongSortKey& b) const { return a.song > b.song; }
+};
+
+// Lexicographic combination: orders by First, then Second among ties.
+template <typename First, typename Second>
+struct ThenBy {
+    First first; Second second;
+    bool operator()(const SongSortKey& a, const SongSortKey& b) const {
+        if (first(a, b)) return true;
+        if (first(b, a)) return false;
+        return second(a, b);
+    }
+};
+
+template <typename Cmp>
+struct StableKeyCmp {
+    Cmp cmp;
+    bool operator()(const SongSortKey& a, const SongSortKey& b) const {
+        if (cmp(a, b)) return true;
+        if (cmp(b, a)) return false;
+        return a.index < b.index;
+    }
+};
+
+template <typename It, typename Cmp>
+void insertion_sort_keys(It first, It last, const Cmp& cmp) {
+    for (It i = first + 1; i < last; ++i) {
+        auto value = *i;
+        It j = i;
+        for (; j > first && cmp(value, *(j - 1)); --j) *j = *(j - 1);
+        *j = value;
+    }
+}
+
+// Median-of-three Hoare partition; returns the split point.
+template <typename It, typename Cmp>
+It partition_keys(It first, It last, const Cmp& cmp) {
+    It mid = first + (last - first) / 2;
+    It back = last - 1;
+    if (cmp(*mid, *first)) swap(*mid, *first);
+    if (cmp(*back, *mid)) {
+        swap(*back, *mid);
+        if (cmp(*mid, *first)) swap(*mid, *first);
+    }
+    auto pivot = *mid;
+    It i = first - 1, j = last;
+    while (true) {
+        do ++i; while (cmp(*i, pivot));
+        do --j; while (cmp(pivot, *j));
+        if (i >= j) return j + 1;
+        swap(*i, *j);
+    }
+}
+
+// Introsort: quicksort that recurses into the smaller side, falls back to
+// heapsort when the depth budget runs out, and finishes with insertion sort.
+// While spawn_levels remain, the left side of each split gets its own thread.
+template <typename It, typename Cmp>
+void introsort_keys(It first, It last, const Cmp& cmp, int depth, int spawn_levels) {
+    while (last - first > 16) {
+        if (depth-- == 0) {
+            make_heap(first, last, cmp);
+            sort_heap(first, last, cmp);
+            return;
+        }
+        It split = partition_keys(first, last, cmp);
+        if (spawn_levels > 0) {
+            int subsystem = current_subsystem;
+            thread left([=, &cmp]() {
+                SubsystemScope scope(subsystem);
+                introsort_keys(first, split, cmp, depth, spawn_levels - 1);
+            });
+            introsort_keys(split, last, cmp, depth, spawn_levels - 1);
+            left.join();
+            return;
+        }
+        if (split - first < last - split) {
+            introsort_keys(first, split, cmp, depth, 0);
+            first = split;
+        } else {
+            introsort_keys(split, last, cmp, depth, 0);
+            last = split;
+        }
+    }
+    if (last - first > 1) insertion_sort_keys(first, last, cmp);
+}
+
+// Stable multi-key sort of songs in place. parallel splits the top levels
+// of the recursion across hardware threads (worth it for very large lists).
+template <typename Cmp>
+void sort_songs(vector<SongId>& songs, const SongStore& store, Cmp cmp, bool parallel = false) {
+    ScopedMetric timer(metric_sort);
+    size_t n = songs.size();
+    if (n <= 1) return;
+    vector<SongSortKey> keys(n);
+    for (size_t i = 0; i < n; ++i) {
+        SongId s = songs[i];
+        keys[i] = {&store.title(s), &store.artist(s), store.duration(s), s, (uint32_t)i};
+    }
+
+    int depth = 0;
+    for (size_t m = n; m > 1; m >>= 1) depth += 2;
+    int spawn_levels = 0;
+    if (parallel) {
+        for (unsigned t = thread::hardware_concurrency(); t > 1; t >>= 1) spawn_levels++;
+    }
+    StableKeyCmp<Cmp> stable{cmp};
+    introsort_keys(keys.begin(), keys.end(), stable, depth, spawn_levels);
+
+    for (size_t i = 0; i < n; ++i) songs[i] = keys[i].song;
+}
+
+// Sorts by a menu choice ("1".."4"); false if the choice is unknown.
+bool sort_by_choice(vector<SongId>& songs, const SongStore& store, const string& choice) {
+    bool parallel = songs.size() >= 100000;
+    if (choice == "1")
+        sort_songs(songs, store, ByTitle(), parallel);
+    else if (choice == "2")
+        sort_songs(songs, store, ByDuration(), parallel);
+    else if (choice == "3")
+        sort_songs(songs, store, ByRecentlyAdded(), parallel);
+    else if (choice == "4")
+        sort_songs(songs, store, ThenBy<ByArtist, ThenBy<ByDuration, ByTitle>>(), parallel);
+    else return false;
+    return true;
+}
+
+// ================= Time-Fill Suggestions (Bitset Knapsack) =================
+// Picks the subset of playlist songs that best fills a time window.
+// FILL_TIME solves subset-sum with a word-parallel bitset (reach |= reach
+// << d per song); the weighted objectives run a 0/1 knapsack that maximizes
+// total rating or listen time first and filled seconds second. Within one
+// duration only the floor(window / d) best candidates can ever be used, so
+// the DP size depends on the window, not on the playlist length.
+// When the table would exceed its cell budget (or approximate mode is
+// requested), durations are rounded up to a coarser granularity, never
+// coarser than the shortest song. If that is still too large, the longest
+// (or densest, when weighted) songs are committed greedily until the rest
+// of the window fits the budget. Either way the plan is then topped up
+// with unused songs at their real durations and is never worse than the
+// plain greedy pass. A window that holds the whole playlist returns every
+// song.
+enum FillObjective { FILL_TIME, FILL_RATING, FILL_LISTEN_TIME };
+
+struct TimeFill {
+    vector<SongId> songs;   // in playlist order
+    int total_seconds;
+    long long weight;       // summed rating / listen time (0 for FILL_TIME)
+};
+
+struct TimeFillPlan {
+    vector<TimeFill> fills; // best first, then alternatives with other totals
+    int granularity;        // seconds per DP unit; 1 = exact
+};
+
+class TimeFillPlanner {
+    static const size_t EXACT_CELL_BUDGET = size_t(1) << 27;
+    static const size_t APPROX_CELL_BUDGET = size_t(1) << 21;
+
+    struct Item {
+        SongId song;
+        int seconds;
+        int units;          // duration in DP units (rounded up)
+        long long weight;
+        uint32_t order;     // position among the songs that fit the window
+    };
+
+    const SongStore& store;
+    FillObjective objective;
+
+    long long _weight(SongId s) const {
+        if (objective == FILL_RATING) return store.rating(s);
+        if (objective == FILL_LISTEN_TIME) return store.listen_time(s);
+        return 0;
+    }
+
+    static int _units(int seconds, int g) { return (seconds + g - 1) / g; }
+
+    // DP cells (bits for FILL_TIME rows, entries for the weighted table)
+    // needed at granularity g, from (duration, count) pairs.
+    static size_t _cells(const vector<pair<int, size_t>>& histogram, int window, int g) {
+        int cap = window / g;
+        map<int, size_t> merged;
+        for (auto& kv : histogram) merged[_units(kv.first, g)] += kv.second;
+        size_t items = 0;
+        for (auto& kv : merged) items += min(kv.second, (size_t)(cap / kv.first));
+        return items * (((size_t)cap + 64) & ~(size_t)63);
+    }
+
+    // Smallest granularity, up to the shortest duration, whose table fits
+    // the budget; 0 if none does.
+    static int _granularity(const vector<pair<int, size_t>>& histogram, int window, size_t budget) {
+        int shortest = histogram.front().first, g = 1;
+        while (_cells(histogram, window, g) > budget) {
+            if (g >= shortest) return 0;
+            g = min(g * 2, shortest);
+        }
+        return g;
+    }
+
+    // Keeps at most cap / units unused candidates per duration: the
+    // earliest for FILL_TIME, the heaviest (earliest on ties) otherwise.
+    vector<Item> _candidates(const vector<Item>& all, const vector<bool>& used, int window, int g) const {
+        int cap = window / g;
+        map<int, vector<Item>> groups;
+        for (size_t i = 0; i < all.size(); ++i) {
+            if (used[i] || all[i].seconds > window) continue;
+            Item item = all[i];
+            item.units = _units(item.seconds, g);
+            groups[item.units].push_back(item);
+        }
+        vector<Item> items;
+        for (auto& kv : groups) {
+            vector<Item>& group = kv.second;
+            size_t keep = min(group.size(), (size_t)(cap / kv.first));
+            if (objective != FILL_TIME)
+                partial_sort(group.begin(), group.begin() + keep, group.end(),
+                             [](const Item& a, const Item& b) {
+                                 return a.weight != b.weight ? a.weight > b.weight : a.order < b.order;
+                             });
+            items.insert(items.end(), group.begin(), group.begin() + keep);
+        }
+        return items;
+    }
+
+    // Builds a fill from the used flags. Inexact plans are first topped up
+    // with the longest unused songs that still fit, at real durations.
+    TimeFill _fill(const vector<Item>& all, const vector<uint32_t>& longest_first, vector<bool>& used,
+                   int window, bool top_up) const {
+        if (top_up) {
+            int total = 0;
+            for (size_t i = 0; i < all.size(); ++i)
+                if (used[i]) total += all[i].seconds;
+            for (uint32_t i : longest_first)
+                if (!used[i] && total + all[i].seconds <= window) { used[i] = true; total += all[i].seconds; }
+        }
+        TimeFill fill = {{}, 0, 0};
+        for (size_t i = 0; i < all.size(); ++i) {
+            if (!used[i]) continue;
+            fill.songs.push_back(all[i].song);
+            fill.total_seconds += all[i].seconds;
+            fill.weight += all[i].weight;
+        }
+        return fill;
+    }
+
+    // Subset-sum: row i holds the sums reachable with the first i items
+    // (items[0..i-1]), so row 0 is the empty set and backtracking asks row i
+    // whether items[i] was needed. Returns the orders of the songs picked
+    // for each of the best totals.
+    vector<vector<uint32_t>> _plan_fill(const vector<Item>& items, int window, int g, size_t count) const {
+        int cap = window / g;
+        size_t words = (size_t)cap / 64 + 1;
+        vector<uint64_t> rows((items.size() + 1) * words, 0);
+        rows[0] = 1; // row 0: only the empty sum
+        for (size_t i = 0; i < items.size(); ++i) {
+            const uint64_t* prev = &rows[i * words];
+            uint64_t* cur = &rows[(i + 1) * words];
+            size_t word_shift = (size_t)items[i].units / 64, bit_shift = (size_t)items[i].units % 64;
+            for (size_t w = 0; w < words; ++w) {
+                uint64_t shifted = 0;
+                if (w >= word_shift) {
+                    shifted = prev[w - word_shift] << bit_shift;
+                    if (bit_shift && w > word_shift) shifted |= prev[w - word_shift - 1] >> (64 - bit_shift);
+                }
+                cur[w] = prev[w] | shifted;
+            }
+        }
+        auto reachable = [&](size_t row, int sum) {
+            return (rows[row * words + (size_t)sum / 64] >> (sum % 64)) & 1;
+        };
+        vector<vector<uint32_t>> picks;
+        for (int sum = cap; sum > 0 && picks.size() < count; --sum) {
+            if (!reachable(items.size(), sum)) continue;
+            picks.emplace_back();
+            int left = sum;
+            for (size_t i = items.size(); i-- > 0 && left > 0;) {
+                if (reachable(i, left)) continue;
+                picks.back().push_back(items[i].order);
+                left -= items[i].units;
+            }
+        }
+        return picks;
+    }
+
+    // 0/1 knapsack over exact totals; score = weight * (cap + 1) + units,
+    // so weight dominates and filled time breaks ties.
+    vector<vector<uint32_t>> _plan_weighted(const vector<Item>& items, int window, int g, size_t count) const {
+        int cap = window / g;
+        size_t stride = (size_t)cap / 64 + 1;
+        vector<long long> best((size_t)cap + 1, -1);
+        vector<uint64_t> take(items.size() * stride, 0);
+        best[0] = 0;
+        for (size_t i = 0; i < items.size(); ++i) {
+            int d = items[i].units;
+            long long gain = items[i].weight * (cap + 1) + d;
+            uint64_t* row = &take[i * stride];
+            for (int c = cap; c >= d; --c) {
+                if (best[c - d] < 0 || best[c - d] + gain <= best[c]) continue;
+                best[c] = best[c - d] + gain;
+                row[c / 64] |= uint64_t(1) << (c % 64);
+            }
+        }
+        vector<int> totals;
+        for (int c = 1; c <= cap; ++c)
+            if (best[c] >= 0) totals.push_back(c);
+        size_t keep = min(count, totals.size());
+        partial_sort(totals.begin(), totals.begin() + keep, totals.end(),
+                     [&](int a, int b) { return best[a] != best[b] ? best[a] > best[b] : a > b; });
+        vector<vector<uint32_t>> picks(keep);
+        for (size_t k = 0; k < keep; ++k) {
+            int left = totals[k];
+            for (size_t i = items.size(); i-- > 0 && left > 0;) {
+                if (!((take[i * stride + (size_t)left / 64] >> (left % 64)) & 1)) continue;
+                picks[k].push_back(items[i].order);
+                left -= items[i].units;
+            }
+        }
+        return picks;
+    }
+
+public:
+    TimeFillPlanner(const SongStore& s, FillObjective obj) : store(s), objective(obj) {}
+
+    // Returns up to 1 + alternatives fills of distinct totals (in DP units).
+    TimeFillPlan plan(const vector<SongId>& songs, int window_sec, size_t alternatives = 0,
+                      bool approximate = false) const {
+        ScopedMetric timer(metric_suggest_plan);
+        TimeFillPlan result = {{}, 1};
+        if (window_sec <= 0) return result;
+        vector<Item> all;
+        long long playlist_total = 0;
+        for (SongId s : songs) {
+            int d = store.duration(s);
+            if (d <= 0 || d > window_sec) continue;
+            all.push_back({s, d, 0, _weight(s), (uint32_t)all.size()});
+            playlist_total += d;
+        }
+        if (all.empty()) return result;
+        vector<bool> used(all.size(), playlist_total <= window_sec);
+        if (playlist_total <= window_sec) {
+            result.fills.push_back(_fill(all, {}, used, window_sec, false));
+            return result;
+        }
+
+        vector<uint32_t> longest_first(all.size());
+        for (uint32_t i = 0; i < all.size(); ++i) longest_first[i] = i;
+        sort(longest_first.begin(), longest_first.end(), [&](uint32_t a, uint32_t b) {
+            return all[a].seconds != all[b].seconds ? all[a].seconds > all[b].seconds : a < b;
+        });
+        vector<uint32_t> commit_order = longest_first;
+        if (objective != FILL_TIME)
+            stable_sort(commit_order.begin(), commit_order.end(), [&](uint32_t a, uint32_t b) {
+                return all[a].weight * all[b].seconds > all[b].weight * all[a].seconds;
+            });
+        // Songs a greedy pass would take, in commit order.
+        vector<uint32_t> greedy;
+        vector<int> committed_seconds(1, 0);
+        for (uint32_t i : commit_order) {
+            if (committed_seconds.back() + all[i].seconds > window_sec) continue;
+            greedy.push_back(i);
+            committed_seconds.push_back(committed_seconds.back() + all[i].seconds);
+        }
+
+        // Distinct durations; each song's slot among them.
+        vector<int> lengths;
+        for (const Item& item : all) lengths.push_back(item.seconds);
+        sort(lengths.begin(), lengths.end());
+        lengths.erase(unique(lengths.begin(), lengths.end()), lengths.end());
+        vector<size_t> length_counts(lengths.size(), 0);
+        vector<uint32_t> slot(all.size());
+        for (size_t i = 0; i < all.size(); ++i) {
+            slot[i] = (uint32_t)(lower_bound(lengths.begin(), lengths.end(), all[i].seconds) - lengths.begin());
+            length_counts[slot[i]]++;
+        }
+        // Granularity for the rest of the window once the first k greedy
+        // songs are committed (0 = still over budget, -1 = nothing fits).
+        size_t budget = approximate ? APPROX_CELL_BUDGET : EXACT_CELL_BUDGET;
+        auto granularity_after = [&](size_t k) {
+            vector<size_t> counts = length_counts;
+            for (size_t j = 0; j < k; ++j) counts[slot[greedy[j]]]--;
+            int rest = window_sec - committed_seconds[k];
+            vector<pair<int, size_t>> histogram;
+            for (size_t j = 0; j < lengths.size() && lengths[j] <= rest; ++j)
+                if (counts[j]) histogram.emplace_back(lengths[j], counts[j]);
+            return histogram.empty() ? -1 : _granularity(histogram, rest, budget);
+        };
+        size_t committed = 0;
+        int g = granularity_after(0);
+        if (g == 0) {
+            // Committing every greedy song leaves nothing that fits, so a
+            // smallest passing prefix exists.
+            size_t lo = 1, hi = greedy.size();
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (granularity_after(mid) != 0) hi = mid;
+                else lo = mid + 1;
+            }
+            committed = lo;
+            g = granularity_after(committed);
+        }
+        for (size_t j = 0; j < committed; ++j) used[greedy[j]] = true;
+        int rest = window_sec - committed_seconds[committed];
+        bool top_up = g != 1 || committed > 0;
+        if (g < 0) {
+            result.fills.push_back(_fill(all, longest_first, used, window_sec, top_up));
+            return result;
+        }
+
+        vector<Item> items = _candidates(all, used, rest, g);
+        vector<vector<uint32_t>> picks = objective == FILL_TIME ? _plan_fill(items, rest, g, 1 + alternatives)
+                                                                : _plan_weighted(items, rest, g, 1 + alternatives);
+        result.granularity = g;
+        for (auto& pick : picks) {
+            vector<bool> chosen = used;
+            for (uint32_t i : pick) chosen[i] = true;
+            result.fills.push_back(_fill(all, longest_first, chosen, window_sec, top_up));
+        }
+        if (top_up) {
+            // A rounded plan can still lose to the plain greedy pass.
+            vector<bool> chosen(all.size(), false);
+            for (uint32_t i : greedy) chosen[i] = true;
+            TimeFill fallback = _fill(all, longest_first, chosen, window_sec, false);
+            const TimeFill& best = result.fills.front();
+            if (fallback.weight > best.weight ||
+                (fallback.weight == best.weight && fallback.total_seconds > best.total_seconds)) {
+                result.fills.insert(result.fills.begin(), std::move(fallback));
+                if (result.fills.size() > 1 + alternatives) result.fills.pop_back();
+            }
+        }
+        return result;
+    }
+};
+
+// ================= Paginated Listings =================
+enum OutputFormat { OUTPUT_TEXT, OUTPUT_TSV };
+
+// A result set shown a page at a time. fetch(offset, limit, fn) calls
+// fn(song) for up to limit songs (0 = all) from position offset on and
+// returns whether any remain after them. The listing keeps its cursor,
+// so the next page resumes where the last one stopped.
+struct Listing {
+    typedef function<bool(size_t, size_t, const function<void(SongId)>&)> Fetch;
+    Fetch fetch;
+    bool numbered;      // text rows start with "<position>. "
+    string header;      // text output only
+    string footer;      // text output only
+    string empty_text;  // text output only, when the listing has no songs
+    size_t next_offset;
+};
+
+Listing playlist_listing(const Playlist& playlist) {
+    Listing listing;
+    listing.fetch = [&playlist](size_t offset, size_t limit, const function<void(SongId)>& fn) {
+        size_t visited = playlist.for_each_range(offset, limit, fn);
+        return offset + visited < (size_t)playlist.size();
+    };
+    listing.numbered = true;
+    listing.header = "\n===========================================\n"
+                     "             CURRENT PLAYLIST\n"
+                     "===========================================\n";
+    listing.footer = "===========================================\n";
+    listing.empty_text = "[EMPTY] No songs in playlist.\n";
+    listing.next_offset = 0;
+    return listing;
+}
+
+// A fixed list (sorted output, search results); the listing owns it, so
+// each page is a slice rather than a new query.
+Listing vector_listing(vector<SongId> songs, const string& empty_text) {
+    auto shared = make_shared<const vector<SongId>>(std::move(songs));
+    Listing listing;
+    listing.fetch = [shared](size_t offset, size_t limit, const function<void(SongId)>& fn) {
+        size_t end = limit ? min(shared->size(), offset + limit) : shared->size();
+        for (size_t i = offset; i < end; ++i) fn((*shared)[i]);
+        return end < shared->size();
+    };
+    listing.numbered = false;
+    listing.empty_text = empty_text;
+    listing.next_offset = 0;
+    return listing;
+}
+
+// Partial (or, with prefix set, leading) title search. The query runs
+// once; later pages read the cached matches.
+Listing search_listing(const SongLookup& lookup, const string& term, bool prefix = false) {
+    return vector_listing(prefix ? lookup.search_by_prefix(term) : lookup.search_by_partial_title(term),
+                          "[NOT FOUND]\n");
+}
+
+// Renders the next page (page_size 0 = everything left), advances the
+// cursor and returns whether more remain. TSV rows are position, song id,
+// title, artist and duration, and the page ends with "#more<TAB><next
+// offset>" or "#end".
+bool render_page(OutputBuffer& out, const SongStore& store, Listing& listing, size_t page_size,
+                 OutputFormat format) {
+    size_t first = listing.next_offset, position = first;
+    if (format == OUTPUT_TEXT) out << listing.header;
+    bool more = listing.fetch(first, page_size, [&](SongId s) {
+        if (format == OUTPUT_TSV) {
+            out << position << '\t' << s << '\t';
+            out.field(store.title(s)) << '\t';
+            out.field(store.artist(s)) << '\t' << store.duration(s) << '\n';
+        } else {
+            if (listing.numbered) out << position << ". ";
+            render_song(out, store, s) << '\n';
+        }
+        position++;
+    });
+    listing.next_offset = position;
+    if (format == OUTPUT_TSV) {
+        if (more) out << "#more\t" << position << '\n';
+        else out << "#end\n";
+    } else {
+        if (position == 0) out << listing.empty_text;
+        out << listing.footer;
+        if (more)
+            out << "[INFO] Showing " << first << "-" << position - 1 << ". Choose 34 for the next page.\n";
+    }
+    out.flush();
+    return more;
+}
+
+// ================= Utility Functions =================
+void playlist_duration_summary(const Playlist& playlist, const SongStore& store) {
+    if (playlist.size() == 0) {
+        cout << "[EMPTY] Playlist is empty.\n";
+        return;
+    }
+    cout << "Total Playtime: " << playlist.total_duration() << " sec\n";
+    cout << "Longest Song: " << store.display(playlist.longest_song()) << "\n";
+    cout << "Shortest Song: " << store.display(playlist.shortest_song()) << "\n";
+}
+
+// Blocks or unblocks an artist and cascades in one step: every playlist
+// re-derives its hidden nodes and the artist's songs leave or re-enter
+// FavoriteQueue. SongLookup and suggestions read the blocked bit directly.
+// The artist index also keeps songs that were deleted since; only songs
+// still in the playlist or a saved playlist are restored and counted.
+// Returns the number of the artist's songs affected (-1 if unchanged).
+int set_artist_blocked(const string& artist, bool blocked, SongStore& store, Playlist& playlist,
+                       PlaylistLibrary& library, FavoriteQueue& favorites) {
+    const vector<SongId>* songs = store.artist_index().set_blocked(artist, blocked);
+    if (!songs) return -1;
+    if (songs->empty()) return 0;
+    playlist.refresh_hidden();
+    library.refresh_hidden();
+    int affected = 0;
+    for (SongId s : *songs) {
+        if (blocked) favorites.remove(s);
+        if (!playlist.contains(s) && !library.contains(s)) continue;
+        affected++;
+        if (!blocked && store.listen_time(s) > 0) favorites.add_or_update(s);
+    }
+    return affected;
+}
+
+// "90s", "45m", "1h", "7d": the largest unit that divides evenly.
+static string format_window(long long seconds) {
+    if (seconds % 86400 == 0) return to_string(seconds / 86400) + "d";
+    if (seconds % 3600 == 0) return to_string(seconds / 3600) + "h";
+    if (seconds % 60 == 0) return to_string(seconds / 60) + "m";
+    return to_string(seconds) + "s";
+}
+
+// Top five songs of each trending window by decayed play count, with the
+// number of plays in the last window as of the latest batch (counted over
+// the retained history). Counts are decayed on to `now`.
+void show_trending(const PlayViews& views, const SongStore& store, long long now) {
+    for (const TrendingView& w : views.trending) {
+        string window = format_window(w.window_ms / 1000);
+        double decay = exp2((double)(views.published_at_ms - now) / w.window_ms);
+        cout << "Trending (half-life " << window << ", " << w.plays
+             << " plays in the last " << window << "):\n";
+        size_t shown = 0;
+        for (auto& item : w.top) {
+            if (store.is_blocked(item.first)) continue;
+            char plays[32];
+            snprintf(plays, sizeof(plays), "%.1f", item.second * decay);
+            cout << "  " << store.title(item.first) << " - " << plays << " plays\n";
+            if (++shown == 5) break;
+        }
+        if (!shown) cout << "  (no plays yet)\n";
+    }
+}
+
+void export_snapshot(const Playlist& playlist, const SongStore& store,
+                     const PlayViews& views, SongRatingBST& ratings) {
+    OutputBuffer out(cout);
+    out << "--- System Snapshot ---\n";
+    out << "Top 5 Longest Songs:\n";
+    for (SongId s : playlist.top_by_duration(5))
+        render_song(out, store, s) << '\n';
+
+    out << "Recently Played:\n";
+    for (size_t i = 0; i < views.recent_plays.size() && i < 5; ++i)
+        render_song(out, store, views.recent_plays[i].song) << '\n';
+
+    RatingSummary summary = ratings.visible_summary();
+    out << "Song Count by Rating:\n";
+    for (auto& kv : summary.counts)
+        out << kv.first << " stars: " << kv.second << '\n';
+    if (summary.rated)
+        out << "Average Rating: " << summary.average << '\n';
+}
+
+void suggest_time_fitting_songs(const Playlist& playlist, const SongStore& store,
+                                int available_time_sec, FillObjective objective = FILL_TIME,
+                                bool approximate = false, size_t alternatives = 2) {
+    TimeFillPlanner planner(store, objective);
+    TimeFillPlan plan = planner.plan(playlist.all_songs(), available_time_sec, alternatives, approximate);
+
+    cout << "\n[Suggestion] Songs that fit in " << available_time_sec << " seconds:\n";
+    if (plan.fills.empty()) {
+        cout << "[INFO] No songs fit within given duration.\n";
+        return;
+    }
+    if (plan.granularity > 1)
+        cout << "[INFO] Approximate fill: durations rounded up to " << plan.granularity << " sec.\n";
+    for (size_t i = 0; i < plan.fills.size(); ++i) {
+        const TimeFill& fill = plan.fills[i];
+        if (i > 0) cout << "[Alternative " << i << "]\n";
+        for (SongId s : fill.songs) cout << "- " << store.display(s) << "\n";
+        cout << "[Total Duration] " << fill.total_seconds << " seconds used";
+        if (objective == FILL_RATING) cout << ", total rating " << fill.weight;
+        else if (objective == FILL_LISTEN_TIME) cout << ", " << fill.weight << " sec listened before";
+        cout << ".\n";
+    }
+}
+
+// ================= Catalog Import (mmap + Parallel Parse) =================
+// CSV catalogs hold one song per line: title,artist,duration[,rating].
+// Fields may be double-quoted ("" escapes a quote) but may not span lines;
+// a first line starting with "title," is treated as a header.
+// Binary catalogs start with CATALOG_MAGIC and a uint32 record count, then
+// per record: uint16 title length, title bytes, uint16 artist length,
+// artist bytes, uint32 duration, uint8 rating (0 = unrated), little-endian.
+const char CATALOG_MAGIC[8] = {'P', 'W', 'C', 'A', 'T', '0', '0', '1'};
+
+class MappedFile {
+    const char* data_;
+    size_t size_;
 public:
-    int song_id;
+    explicit MappedFile(const string& path) : data_(nullptr), size_(0) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data_ = (const char*)p;
+                size_ = (size_t)st.st_size;
+                madvise(p, size_, MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);
+    }
+    ~MappedFile() { if (data_) munmap((void*)data_, size_); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool ok() const { return data_ != nullptr; }
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+};
+
+struct CatalogRecord {
     string title;
     string artist;
-    int duration; // seconds
-    int rating;   // 1-5 or 0/unrated
-    int total_listen_time;
+    string key;   // SongStore::song_key(title, artist)
+    int duration;
+    int rating;   // 0 = unrated
+    bool blocked;
+};
 
-    Song(int id, string t, string a, int d)
-        : song_id(id), title(t), artist(a), duration(d),
-          rating(0), total_listen_time(0) {}
+struct ImportStats {
+    size_t imported, blocked, duplicates, malformed;
+    double elapsed_ms;
+};
 
-    string display() const {
-        return title + " by " + artist + " (" + to_string(duration) + " sec)";
+// Reads one CSV field starting at p; leaves p after the delimiter.
+static bool read_csv_field(const char*& p, const char* end, string& out) {
+    out.clear();
+    if (p < end && *p == '"') {
+        for (++p; p < end; ++p) {
+            if (*p != '"') { out += *p; continue; }
+            if (p + 1 < end && p[1] == '"') { out += '"'; ++p; continue; }
+            ++p;
+            break;
+        }
+    } else {
+        const char* start = p;
+        while (p < end && *p != ',') ++p;
+        out.assign(start, p);
     }
-};
+    if (p < end && *p != ',') return false;
+    if (p < end) ++p;
+    return true;
+}
 
-// ================= Playlist (Doubly Linked List) =================
-struct PlaylistNode {
-    shared_ptr<Song> song;
-    PlaylistNode* prev;
-    PlaylistNode* next;
-    PlaylistNode(shared_ptr<Song> s) : song(s), prev(nullptr), next(nullptr) {}
-};
+// Reads an unquoted non-negative integer field (at most 9 digits).
+static bool read_csv_int(const char*& p, const char* end, int& out) {
+    const char* start = p;
+    out = 0;
+    while (p < end && *p >= '0' && *p <= '9' && p - start < 9) out = out * 10 + (*p++ - '0');
+    if (p == start || (p < end && *p != ',')) return false;
+    if (p < end) ++p;
+    return true;
+}
 
-class Playlist {
-private:
-    PlaylistNode* head;
-    PlaylistNode* tail;
-    int length;
+static bool parse_csv_line(const char* p, const char* end, CatalogRecord& rec) {
+    if (end > p && end[-1] == '\r') --end;
+    if (!read_csv_field(p, end, rec.title) || !read_csv_field(p, end, rec.artist) ||
+        !read_csv_int(p, end, rec.duration)) return false;
+    rec.rating = 0;
+    if (p < end && (!read_csv_int(p, end, rec.rating) || p != end || rec.rating > 5)) return false;
+    return !rec.title.empty() && !rec.artist.empty() && rec.duration > 0;
+}
 
-public:
-    Playlist() : head(nullptr), tail(nullptr), length(0) {}
-    ~Playlist() {
-        while (head) {
-            PlaylistNode* next = head->next;
-            delete head;
-            head = next;
+static void parse_csv_chunk(const char* begin, const char* end, const ArtistIndex& artists,
+                            vector<CatalogRecord>& out, size_t& malformed) {
+    const char* p = begin;
+    while (p < end) {
+        const char* eol = (const char*)memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+        if (eol > p && !(eol == p + 1 && *p == '\r')) {
+            CatalogRecord rec;
+            if (parse_csv_line(p, eol, rec)) {
+                rec.blocked = artists.is_blocked_name(rec.artist);
+                rec.key = SongStore::song_key(rec.title, rec.artist);
+                out.push_back(std::move(rec));
+            } else malformed++;
         }
+        p = eol + 1;
     }
+}
 
-    bool exists(const string& title, const string& artist) const {
-        string t = title, a = artist;
-        transform(t.begin(), t.end(), t.begin(), ::tolower);
-        transform(a.begin(), a.end(), a.begin(), ::tolower);
-        PlaylistNode* curr = head;
-        while (curr) {
-            string ct = curr->song->title, ca = curr->song->artist;
-            transform(ct.begin(), ct.end(), ct.begin(), ::tolower);
-            transform(ca.begin(), ca.end(), ca.begin(), ::tolower);
-            if (ct == t && ca == a) return true;
-            curr = curr->next;
-        }
-        return false;
+static bool parse_binary_catalog(const char* p, const char* end, const ArtistIndex& artists,
+                                 vector<CatalogRecord>& out, size_t& malformed) {
+    auto read_u16 = [&](uint16_t& v) {
+        if (end - p < 2) return false;
+        v = (uint16_t)((unsigned char)p[0] | ((unsigned char)p[1] << 8)); p += 2; return true;
+    };
+    auto read_u32 = [&](uint32_t& v) {
+        if (end - p < 4) return false;
+        v = (uint32_t)(unsigned char)p[0] | ((uint32_t)(unsigned char)p[1] << 8) |
+            ((uint32_t)(unsigned char)p[2] << 16) | ((uint32_t)(unsigned char)p[3] << 24);
+        p += 4; return true;
+    };
+    p += sizeof(CATALOG_MAGIC);
+    uint32_t count;
+    if (!read_u32(count)) return false;
+    out.reserve(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        CatalogRecord rec;
+        uint16_t len;
+        uint32_t duration;
+        if (!read_u16(len) || end - p < len) return false;
+        rec.title.assign(p, len); p += len;
+        if (!read_u16(len) || end - p < len) return false;
+        rec.artist.assign(p, len); p += len;
+        if (!read_u32(duration) || end - p < 1) return false;
+        rec.rating = (unsigned char)*p++;
+        rec.duration = (int)duration;
+        if (rec.title.empty() || rec.artist.empty() || rec.duration <= 0 ||
+            duration > 999999999u || rec.rating > 5) { malformed++; continue; }
+        rec.blocked = artists.is_blocked_name(rec.artist);
+        rec.key = SongStore::song_key(rec.title, rec.artist);
+        out.push_back(std::move(rec));
+    }
+    return true;
+}
+
+// Writes songs in the binary catalog format import_catalog reads back.
+// Returns false if the file could not be written.
+bool write_binary_catalog(const string& path, const SongStore& store, const vector<SongId>& songs) {
+    ofstream out(path, ios::binary);
+    if (!out) return false;
+    auto put_u16 = [&](uint16_t v) { out.put((char)(v & 0xff)); out.put((char)(v >> 8)); };
+    auto put_u32 = [&](uint32_t v) { for (int i = 0; i < 4; ++i) out.put((char)((v >> (8 * i)) & 0xff)); };
+    out.write(CATALOG_MAGIC, sizeof(CATALOG_MAGIC));
+    put_u32((uint32_t)songs.size());
+    for (SongId s : songs) {
+        const string& t = store.title(s);
+        const string& a = store.artist(s);
+        size_t tl = min<size_t>(t.size(), 0xffff), al = min<size_t>(a.size(), 0xffff);
+        put_u16((uint16_t)tl); out.write(t.data(), tl);
+        put_u16((uint16_t)al); out.write(a.data(), al);
+        put_u32((uint32_t)store.duration(s));
+        out.put((char)store.rating(s));
     }
+    out.flush();
+    return (bool)out;
+}
 
-    int size() const { return length; }
+// Maps the file, parses it (CSV in newline-aligned chunks, one per hardware
+// thread), then filters blocked artists and duplicates and bulk-loads the
+// survivors into the store, playlist, lookup and rating indexes in order.
+bool import_catalog(const string& path, SongStore& store, Playlist& playlist,
+                    SongLookup& lookup, SongRatingBST& ratings, ImportStats& stats) {
+    ScopedMetric timer(metric_import);
+    auto start = chrono::steady_clock::now();
+    stats = ImportStats{0, 0, 0, 0, 0.0};
+    MappedFile file(path);
+    if (!file.ok()) return false;
+    const char* begin = file.data();
+    const char* end = begin + file.size();
 
-    void add_song(shared_ptr<Song> song) {
-        PlaylistNode* node = new PlaylistNode(song);
-        if (!head) head = tail = node;
-        else {
-            tail->next = node;
-            node->prev = tail;
-            tail = node;
+    vector<vector<CatalogRecord>> parts(1);
+    vector<size_t> malformed(1, 0);
+    if (file.size() >= sizeof(CATALOG_MAGIC) &&
+        memcmp(begin, CATALOG_MAGIC, sizeof(CATALOG_MAGIC)) == 0) {
+        if (!parse_binary_catalog(begin, end, store.artist_index(), parts[0], malformed[0])) malformed[0]++;
+    } else {
+        if (end - begin >= 6 && memcmp(begin, "title,", 6) == 0) {
+            const char* eol = (const char*)memchr(begin, '\n', end - begin);
+            begin = eol ? eol + 1 : end;
+        }
+        size_t workers = max(1u, thread::hardware_concurrency());
+        if ((size_t)(end - begin) < (1u << 20)) workers = 1;
+        vector<const char*> cuts(1, begin);
+        for (size_t i = 1; i < workers; ++i) {
+            const char* cut = begin + (end - begin) * i / workers;
+            if (cut < cuts.back()) cut = cuts.back();
+            const char* eol = (const char*)memchr(cut, '\n', end - cut);
+            cuts.push_back(eol ? eol + 1 : end);
         }
-        length++;
+        cuts.push_back(end);
+        parts.assign(workers, vector<CatalogRecord>());
+        malformed.assign(workers, 0);
+        vector<thread> pool;
+        for (size_t i = 1; i < workers; ++i)
+            pool.emplace_back([&, i]() {
+                SubsystemScope scope(SUB_IMPORT);
+                parse_csv_chunk(cuts[i], cuts[i + 1], store.artist_index(), parts[i], malformed[i]);
+            });
+        parse_csv_chunk(cuts[0], cuts[1], store.artist_index(), parts[0], malformed[0]);
+        for (auto& t : pool) t.join();
     }
 
-    void delete_song(int idx, function<void(shared_ptr<Song>)> remove_from_lookup) {
-        if (idx < 0 || idx >= length) {
-            cout << "\n[ERROR] Invalid index. No song deleted.\n";
-            return;
+    size_t total = 0;
+    for (size_t i = 0; i < parts.size(); ++i) {
+        total += parts[i].size();
+        stats.malformed += malformed[i];
+    }
+    store.reserve(store.size() + total);
+    // In-batch duplicates are detected through pointers to the records' own
+    // keys, so no key is copied.
+    auto key_hash = [](const string* k) { return hash<string>()(*k); };
+    auto key_eq = [](const string* a, const string* b) { return *a == *b; };
+    unordered_set<const string*, decltype(key_hash), decltype(key_eq)>
+        batch_keys(total, key_hash, key_eq);
+    vector<CatalogRecord*> accepted;
+    accepted.reserve(total);
+    for (auto& part : parts) {
+        for (auto& rec : part) {
+            if (rec.blocked) { stats.blocked++; continue; }
+            if (playlist.exists_key(rec.key) || !batch_keys.insert(&rec.key).second) {
+                stats.duplicates++;
+                continue;
+            }
+            accepted.push_back(&rec);
+        }
+    }
+    batch_keys.clear();
+    // Songs already in the catalog (e.g. through another playlist) are
+    // reused with their existing stats rather than added again.
+    vector<SongId> ids;
+    ids.reserve(accepted.size());
+    for (CatalogRecord* rec : accepted) {
+        SongId id = store.find_by_key(rec->key);
+        if (!id) {
+            id = store.add_song(rec->title, rec->artist, rec->duration);
+            if (rec->rating) store.set_rating(id, rec->rating);
         }
-        PlaylistNode* curr = head;
-        for (int i = 0; i < idx; ++i) curr = curr->next;
+        ids.push_back(id);
+    }
+    vector<vector<CatalogRecord>>().swap(parts);
+    playlist.append_bulk(ids);
+    lookup.add_bulk(ids);
+    ratings.add_bulk(ids);
 
-        remove_from_lookup(curr->song);
+    stats.imported = ids.size();
+    stats.elapsed_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    return true;
+}
 
-        if (curr->prev) curr->prev->next = curr->next;
-        else head = curr->next;
-        if (curr->next) curr->next->prev = curr->prev;
-        else tail = curr->prev;
-        delete curr;
-        length--;
-        cout << "\n[INFO] Song deleted successfully.\n";
+// ================= Persistent Snapshot (Binary Image) =================
+// File layout (host byte order, every section 8-byte aligned so the store
+// columns are copied straight out of the mapping; the playlist treap, song
+// keys, lookup and rating indexes are rebuilt from them on load):
+//   header   : magic "PWSNAP01", u32 version, u32 section count
+//   table    : per section { u32 id, u32 reserved, u64 offset, u64 bytes }
+//   sections : flat arrays; string sections are u64 count, u64 offsets[count + 1], bytes
+// Column sections cover every store slot including slot 0. The library
+// sections (named playlists) are optional; each saved playlist is stored as
+// u32 count followed by its song ids, so sharing is not preserved on disk.
+// The optional log generation (u64) names the first operation log segment
+// that is not yet folded into the image. The optional co-play section is
+// the model's landmark (i64) followed by its edges.
+const char SNAPSHOT_MAGIC[8] = {'P', 'W', 'S', 'N', 'A', 'P', '0', '1'};
+const uint32_t SNAPSHOT_VERSION = 1;
+
+enum SnapshotSectionId : uint32_t {
+    SNAP_STRINGS = 1, SNAP_TITLE_REFS, SNAP_ARTIST_REFS, SNAP_DURATIONS, SNAP_RATINGS,
+    SNAP_LISTEN_TIMES, SNAP_PLAYLIST, SNAP_RATED, SNAP_FAVORITES, SNAP_HISTORY, SNAP_BLOCKED,
+    SNAP_LIBRARY_NAMES, SNAP_LIBRARY_SONGS, SNAP_LOG_GENERATION, SNAP_COPLAY
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+};
+
+struct SnapshotSectionEntry {
+    uint32_t id;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t bytes;
+};
+
+struct SnapshotHistoryRecord {
+    int64_t played_at_ms;
+    uint32_t song;
+    uint32_t reserved;
+};
+
+struct SnapshotCoPlayEdge {
+    uint32_t from;
+    uint32_t to;
+    float weight;
+    uint32_t reserved;
+};
+
+struct SnapshotPart {
+    uint32_t id;
+    const void* data;
+    size_t bytes;
+};
+
+static size_t align8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+template <typename StringAt>
+static vector<char> encode_strings(size_t count, StringAt string_at) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; ++i) bytes += string_at(i).size();
+    vector<char> out(8 * (count + 2) + bytes);
+    uint64_t* header = (uint64_t*)out.data();
+    header[0] = count;
+    char* blob = out.data() + 8 * (count + 2);
+    uint64_t pos = 0;
+    for (size_t i = 0; i < count; ++i) {
+        header[1 + i] = pos;
+        const string& s = string_at(i);
+        memcpy(blob + pos, s.data(), s.size());
+        pos += s.size();
     }
+    header[1 + count] = pos;
+    return out;
+}
 
-    // New swap-based move_song
-    void move_song(int from_idx, int to_idx) {
-        if (from_idx < 0 || from_idx >= length || to_idx < 0 || to_idx >= length) {
-            cout << "\n[ERROR] Invalid index. Move operation aborted.\n";
-            return;
-        }
-        if (from_idx == to_idx) {
-            cout << "\n[INFO] No movement needed (same index).\n";
-            return;
-        }
+// Calls fn(ptr, len) for every string of an encoded section; false if malformed.
+template <typename Fn>
+static bool decode_strings(const char* data, size_t bytes, Fn fn) {
+    if (bytes < 16) return false;
+    const uint64_t* header = (const uint64_t*)data;
+    uint64_t count = header[0];
+    if (count > bytes / 8 || 8 * (count + 2) > bytes) return false;
+    const char* blob = data + 8 * (count + 2);
+    size_t blob_bytes = bytes - 8 * (count + 2);
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t b = header[1 + i], e = header[2 + i];
+        if (b > e || e > blob_bytes) return false;
+        if (!fn(blob + b, (size_t)(e - b))) return false;
+    }
+    return true;
+}
+
+static vector<char> assemble_snapshot(const vector<SnapshotPart>& parts) {
+    size_t offset = align8(sizeof(SnapshotHeader) + parts.size() * sizeof(SnapshotSectionEntry));
+    vector<SnapshotSectionEntry> table;
+    for (auto& part : parts) {
+        table.push_back({part.id, 0, offset, part.bytes});
+        offset = align8(offset + part.bytes);
+    }
+    vector<char> image(offset, 0);
+    SnapshotHeader header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.section_count = (uint32_t)parts.size();
+    memcpy(image.data(), &header, sizeof(header));
+    memcpy(image.data() + sizeof(header), table.data(), table.size() * sizeof(SnapshotSectionEntry));
+    for (size_t i = 0; i < parts.size(); ++i)
+        if (parts[i].bytes) memcpy(image.data() + table[i].offset, parts[i].data, parts[i].bytes);
+    return image;
+}
 
-        PlaylistNode* node1 = head;
-        for (int i = 0; i < from_idx; ++i) node1 = node1->next;
+// Captures the full system state as one contiguous image. This is the only
+// part of a checkpoint that runs on the command loop: columns are copied
+// as-is, so the cost is a memcpy plus one pass over the string pool.
+vector<char> capture_snapshot(const SongStore& store, const Playlist& playlist,
+                              const PlaylistLibrary& library, const SongRatingBST& ratings,
+                              const FavoriteQueue& favorites, const PlaybackHistory& history,
+                              uint64_t log_generation) {
+    ScopedMetric timer(metric_snapshot_capture);
+    const StringPool& pool = store.string_pool();
+    vector<char> strings = encode_strings(pool.size(), [&](size_t i) -> const string& { return pool.get((uint32_t)i); });
+    vector<string> blocked = store.artist_index().blocked_names();
+    vector<char> blocked_section = encode_strings(blocked.size(), [&](size_t i) -> const string& { return blocked[i]; });
+    vector<SongId> order = playlist.all_songs(true);
+    vector<string> library_names;
+    vector<SongId> library_songs;
+    for (auto& kv : library.all()) {
+        library_names.push_back(kv.first);
+        vector<SongId> songs = kv.second.all_songs(true);
+        library_songs.push_back((SongId)songs.size());
+        library_songs.insert(library_songs.end(), songs.begin(), songs.end());
+    }
+    vector<char> names_section = encode_strings(library_names.size(), [&](size_t i) -> const string& { return library_names[i]; });
+    vector<SongId> rated = ratings.songs_in_range(INT_MIN, INT_MAX);
+    vector<SongId> favored = favorites.songs();
+    vector<SnapshotHistoryRecord> plays;
+    plays.reserve(history.size());
+    for (auto& e : history.recent(history.size()))
+        plays.push_back({e.played_at_ms, e.song, 0});
+    reverse(plays.begin(), plays.end());
+    const CoPlayModel& coplay = history.coplay_model();
+    vector<char> coplay_section(sizeof(int64_t) + coplay.edges() * sizeof(SnapshotCoPlayEdge));
+    int64_t landmark = coplay.landmark();
+    memcpy(coplay_section.data(), &landmark, sizeof(landmark));
+    size_t edge_pos = sizeof(int64_t);
+    coplay.for_each_edge([&](SongId from, SongId to, float weight) {
+        SnapshotCoPlayEdge e = {from, to, weight, 0};
+        memcpy(&coplay_section[edge_pos], &e, sizeof(e));
+        edge_pos += sizeof(e);
+    });
 
-        PlaylistNode* node2 = head;
-        for (int i = 0; i < to_idx; ++i) node2 = node2->next;
+    size_t slots = store.capacity_ids();
+    vector<SnapshotPart> parts = {
+        {SNAP_STRINGS, strings.data(), strings.size()},
+        {SNAP_TITLE_REFS, store.title_ref_column().data(), slots * sizeof(uint32_t)},
+        {SNAP_ARTIST_REFS, store.artist_ref_column().data(), slots * sizeof(uint32_t)},
+        {SNAP_DURATIONS, store.duration_column().data(), slots * sizeof(int32_t)},
+        {SNAP_RATINGS, store.rating_column().data(), slots * sizeof(int32_t)},
+        {SNAP_LISTEN_TIMES, store.listen_time_column().data(), slots * sizeof(int32_t)},
+        {SNAP_PLAYLIST, order.data(), order.size() * sizeof(SongId)},
+        {SNAP_RATED, rated.data(), rated.size() * sizeof(SongId)},
+        {SNAP_FAVORITES, favored.data(), favored.size() * sizeof(SongId)},
+        {SNAP_HISTORY, plays.data(), plays.size() * sizeof(SnapshotHistoryRecord)},
+        {SNAP_BLOCKED, blocked_section.data(), blocked_section.size()},
+        {SNAP_LIBRARY_NAMES, names_section.data(), names_section.size()},
+        {SNAP_LIBRARY_SONGS, library_songs.data(), library_songs.size() * sizeof(SongId)},
+        {SNAP_LOG_GENERATION, &log_generation, sizeof(log_generation)},
+        {SNAP_COPLAY, coplay_section.data(), coplay_section.size()},
+    };
+    return assemble_snapshot(parts);
+}
 
-        swap(node1->song, node2->song);
-        cout << "\n[INFO] Songs swapped successfully.\n";
+// Maps a snapshot, copies the columns out and rebuilds the indexes from
+// them. Must be called on freshly constructed modules, which are left
+// untouched if the image is rejected; log_generation receives the first log
+// segment to replay on top. On failure, error describes the problem.
+bool load_snapshot(const string& path, SongStore& store, Playlist& playlist, PlaylistLibrary& library,
+                   SongLookup& lookup, SongRatingBST& ratings, FavoriteQueue& favorites,
+                   PlaybackHistory& history, uint64_t& log_generation, string& error) {
+    ScopedMetric timer(metric_snapshot_load);
+    MappedFile file(path);
+    if (!file.ok()) { error = "cannot open " + path; return false; }
+    const char* base = file.data();
+    SnapshotHeader header;
+    if (file.size() < sizeof(header)) { error = "truncated header"; return false; }
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) { error = "bad magic"; return false; }
+    if (header.version != SNAPSHOT_VERSION) { error = "unsupported version " + to_string(header.version); return false; }
+    if (header.section_count > 64 ||
+        sizeof(header) + header.section_count * sizeof(SnapshotSectionEntry) > file.size()) {
+        error = "bad section table"; return false;
     }
 
-    void reverse_playlist() {
-        PlaylistNode* curr = head;
-        while (curr) {
-            swap(curr->next, curr->prev);
-            curr = curr->prev;
+    map<uint32_t, pair<const char*, size_t>> sections;
+    const SnapshotSectionEntry* table = (const SnapshotSectionEntry*)(base + sizeof(header));
+    for (uint32_t i = 0; i < header.section_count; ++i) {
+        const SnapshotSectionEntry& e = table[i];
+        if (e.offset % 8 != 0 || e.offset > file.size() || e.bytes > file.size() - e.offset) {
+            error = "section out of bounds"; return false;
         }
-        swap(head, tail);
-        cout << "\n[INFO] Playlist reversed successfully.\n";
+        sections[e.id] = make_pair(base + e.offset, (size_t)e.bytes);
     }
+    for (uint32_t id = SNAP_STRINGS; id <= SNAP_BLOCKED; ++id)
+        if (!sections.count(id)) { error = "missing section " + to_string(id); return false; }
 
-    void show() const {
-        cout << "\n===========================================\n";
-        cout << "             CURRENT PLAYLIST\n";
-        cout << "===========================================\n";
-        if (!head) {
-            cout << "[EMPTY] No songs in playlist.\n";
-        } else {
-            PlaylistNode* curr = head;
-            int idx = 0;
-            while (curr) {
-                cout << idx << ". " << curr->song->display() << endl;
-                curr = curr->next;
-                idx++;
-            }
+    // Everything is decoded and checked before the store is touched, so a
+    // rejected image leaves the modules as they were; strings are staged in
+    // their own pool and handed over with the columns.
+    StringPool strings;
+    uint32_t next_ref = 0;
+    bool strings_ok = decode_strings(sections[SNAP_STRINGS].first, sections[SNAP_STRINGS].second,
+        [&](const char* p, size_t n) { return strings.intern(string(p, n)) == next_ref++; });
+    if (!strings_ok) { error = "bad string pool"; return false; }
+    vector<string> blocked;
+    bool blocked_ok = decode_strings(sections[SNAP_BLOCKED].first, sections[SNAP_BLOCKED].second,
+        [&](const char* p, size_t n) { blocked.emplace_back(p, n); return true; });
+    if (!blocked_ok) { error = "bad blocklist"; return false; }
+
+    size_t slots = sections[SNAP_TITLE_REFS].second / sizeof(uint32_t);
+    const uint32_t column_ids[] = {SNAP_ARTIST_REFS, SNAP_DURATIONS, SNAP_RATINGS, SNAP_LISTEN_TIMES};
+    for (uint32_t id : column_ids)
+        if (sections[id].second != slots * 4) { error = "column size mismatch"; return false; }
+    if (slots == 0) { error = "empty store"; return false; }
+    const uint32_t* title_refs = (const uint32_t*)sections[SNAP_TITLE_REFS].first;
+    const uint32_t* artist_refs = (const uint32_t*)sections[SNAP_ARTIST_REFS].first;
+    for (size_t i = 1; i < slots; ++i)
+        if (title_refs[i] >= next_ref || artist_refs[i] >= next_ref) { error = "bad string ref"; return false; }
+
+    auto id_list = [&](uint32_t id, vector<SongId>& out) {
+        const SongId* p = (const SongId*)sections[id].first;
+        out.assign(p, p + sections[id].second / sizeof(SongId));
+        for (SongId s : out) if (s == NO_SONG || s >= slots) return false;
+        return true;
+    };
+    vector<SongId> order, rated, favored;
+    if (!id_list(SNAP_PLAYLIST, order) || !id_list(SNAP_RATED, rated) || !id_list(SNAP_FAVORITES, favored)) {
+        error = "bad song id"; return false;
+    }
+    const SnapshotHistoryRecord* plays = (const SnapshotHistoryRecord*)sections[SNAP_HISTORY].first;
+    size_t play_count = sections[SNAP_HISTORY].second / sizeof(SnapshotHistoryRecord);
+    for (size_t i = 0; i < play_count; ++i)
+        if (plays[i].song == NO_SONG || plays[i].song >= slots) { error = "bad history entry"; return false; }
+
+    vector<string> library_names;
+    vector<vector<SongId>> library_songs;
+    if (sections.count(SNAP_LIBRARY_NAMES) && sections.count(SNAP_LIBRARY_SONGS)) {
+        bool names_ok = decode_strings(sections[SNAP_LIBRARY_NAMES].first, sections[SNAP_LIBRARY_NAMES].second,
+            [&](const char* p, size_t n) { library_names.emplace_back(p, n); return true; });
+        vector<SongId> flat;
+        const SongId* p = (const SongId*)sections[SNAP_LIBRARY_SONGS].first;
+        flat.assign(p, p + sections[SNAP_LIBRARY_SONGS].second / sizeof(SongId));
+        size_t pos = 0;
+        for (size_t i = 0; names_ok && i < library_names.size(); ++i) {
+            if (pos >= flat.size() || flat[pos] > flat.size() - pos - 1) { names_ok = false; break; }
+            library_songs.emplace_back(flat.begin() + pos + 1, flat.begin() + pos + 1 + flat[pos]);
+            pos += 1 + flat[pos];
+            for (SongId s : library_songs.back()) if (s == NO_SONG || s >= slots) names_ok = false;
+        }
+        if (!names_ok || pos != flat.size()) { error = "bad playlist library"; return false; }
+    }
+    log_generation = 0;
+    if (sections.count(SNAP_LOG_GENERATION)) {
+        if (sections[SNAP_LOG_GENERATION].second != sizeof(uint64_t)) { error = "bad log generation"; return false; }
+        memcpy(&log_generation, sections[SNAP_LOG_GENERATION].first, sizeof(uint64_t));
+    }
+    const SnapshotCoPlayEdge* coplay_edges = nullptr;
+    size_t coplay_count = 0;
+    int64_t coplay_landmark = LLONG_MIN;
+    if (sections.count(SNAP_COPLAY)) {
+        const pair<const char*, size_t>& sec = sections[SNAP_COPLAY];
+        if (sec.second < sizeof(int64_t) || (sec.second - sizeof(int64_t)) % sizeof(SnapshotCoPlayEdge)) {
+            error = "bad co-play section"; return false;
         }
-        cout << "===========================================\n";
+        memcpy(&coplay_landmark, sec.first, sizeof(int64_t));
+        coplay_edges = (const SnapshotCoPlayEdge*)(sec.first + sizeof(int64_t));
+        coplay_count = (sec.second - sizeof(int64_t)) / sizeof(SnapshotCoPlayEdge);
+        for (size_t i = 0; i < coplay_count; ++i)
+            if (coplay_edges[i].from == NO_SONG || coplay_edges[i].from >= slots ||
+                coplay_edges[i].to == NO_SONG || coplay_edges[i].to >= slots) {
+                error = "bad co-play edge"; return false;
+            }
     }
 
-    vector<shared_ptr<Song>> all_songs() const {
-        vector<shared_ptr<Song>> v;
-        PlaylistNode* curr = head;
-        while (curr) { v.push_back(curr->song); curr = curr->next; }
-        return v;
+    store.restore_columns(std::move(strings), title_refs, artist_refs,
+                          (const int32_t*)sections[SNAP_DURATIONS].first,
+                          (const int32_t*)sections[SNAP_RATINGS].first,
+                          (const int32_t*)sections[SNAP_LISTEN_TIMES].first, slots);
+    for (const string& artist : blocked) store.artist_index().set_blocked(artist, true);
+    playlist.append_bulk(order);
+    for (size_t i = 0; i < library_names.size(); ++i) {
+        Playlist saved(store);
+        saved.append_bulk(library_songs[i]);
+        library.save(library_names[i], saved);
     }
-};
+    lookup.add_bulk(order);
+    ratings.add_bulk(rated);
+    for (SongId s : favored) favorites.add_or_update(s);
+    for (size_t i = 0; i < play_count; ++i) history.restore_play(plays[i].song, plays[i].played_at_ms);
+    history.coplay_model().restore_landmark(coplay_landmark);
+    for (size_t i = 0; i < coplay_count; ++i)
+        history.coplay_model().restore_edge(coplay_edges[i].from, coplay_edges[i].to, coplay_edges[i].weight);
+    return true;
+}
 
-// ================= Song Lookup (HashMap) =================
-class SongLookup {
-    unordered_map<int, shared_ptr<Song>> map_by_id;
-    unordered_map<string, shared_ptr<Song>> map_by_title;
+// Writes checkpoint images on a background thread (temp file, fsync,
+// rename), so the command loop never waits on disk. If a checkpoint is
+// submitted while another is being written, only the newest one is kept.
+class SnapshotWriter {
+    mutex mu;
+    condition_variable cv;
+    vector<char> pending;
+    string pending_path;
+    function<void()> pending_done;
+    bool has_pending;
+    bool writing;
+    bool stopping;
+    string last_error;
+    thread worker;
 
-    static string to_lower(const string& s) {
-        string result = s;
-        transform(result.begin(), result.end(), result.begin(), ::tolower);
-        return result;
+    static bool _write_file(const string& path, const vector<char>& image, string& error) {
+        string tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) { error = "cannot create " + tmp; return false; }
+        size_t done = 0;
+        while (done < image.size()) {
+            ssize_t n = ::write(fd, image.data() + done, image.size() - done);
+            if (n <= 0) { ::close(fd); error = "write failed"; return false; }
+            done += (size_t)n;
+        }
+        bool ok = fsync(fd) == 0;
+        ::close(fd);
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) { error = "cannot publish " + path; return false; }
+        return true;
+    }
+
+    void _run() {
+        SubsystemScope scope(SUB_SNAPSHOT);
+        unique_lock<mutex> lock(mu);
+        while (true) {
+            cv.wait(lock, [this] { return has_pending || stopping; });
+            if (!has_pending) return;
+            vector<char> image;
+            image.swap(pending);
+            string path = pending_path;
+            function<void()> on_written;
+            on_written.swap(pending_done);
+            has_pending = false;
+            writing = true;
+            lock.unlock();
+            string error;
+            bool ok;
+            {
+                ScopedMetric timer(metric_snapshot_write);
+                ok = _write_file(path, image, error);
+            }
+            if (ok && on_written) on_written();
+            lock.lock();
+            writing = false;
+            if (!ok) last_error = error;
+            cv.notify_all();
+        }
     }
+
 public:
-    void add_song(shared_ptr<Song> s) {
-        map_by_id[s->song_id] = s;
-        map_by_title[to_lower(s->title)] = s;
+    SnapshotWriter() : has_pending(false), writing(false), stopping(false) {
+        worker = thread(&SnapshotWriter::_run, this);
     }
-    void remove_song(shared_ptr<Song> s) {
-        map_by_id.erase(s->song_id);
-        map_by_title.erase(to_lower(s->title));
+    ~SnapshotWriter() {
+        {
+            lock_guard<mutex> lock(mu);
+            stopping = true;
+        }
+        cv.notify_all();
+        worker.join();
     }
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
 
-    shared_ptr<Song> get_by_title(const string& title) {
-        auto it = map_by_title.find(to_lower(title));
-        return it != map_by_title.end() ? it->second : nullptr;
-    }
-    
-    vector<shared_ptr<Song>> search_by_partial_title(const string& term) {
-        vector<shared_ptr<Song>> results;
-        string t = to_lower(term);
-        for (auto& kv : map_by_title) {
-            if (kv.first.find(t) != string::npos) {
-                results.push_back(kv.second);
-            }
+    // on_written runs on the writer thread once the image is published; it is
+    // dropped along with the image if a newer checkpoint supersedes it.
+    void submit(const string& path, vector<char>&& image, function<void()> on_written = nullptr) {
+        {
+            lock_guard<mutex> lock(mu);
+            pending.swap(image);
+            pending_path = path;
+            pending_done = move(on_written);
+            has_pending = true;
         }
-        return results;
+        cv.notify_all();
+    }
+
+    // Blocks until every submitted checkpoint is on disk; returns the last
+    // write error (empty if none) and clears it.
+    string wait_idle() {
+        unique_lock<mutex> lock(mu);
+        cv.wait(lock, [this] { return !has_pending && !writing; });
+        string error;
+        error.swap(last_error);
+        return error;
     }
 };
 
-// ================= Playback History (Stack) =================
-class PlaybackHistory {
-    stack<shared_ptr<Song>> history;
-public:
-    void play(shared_ptr<Song> song) { history.push(song); }
-    shared_ptr<Song> undo_last_play() {
-        if (history.empty()) return nullptr;
-        shared_ptr<Song> s = history.top(); history.pop();
-        return s;
-    }
-    vector<shared_ptr<Song>> recent(int n) {
-        vector<shared_ptr<Song>> out;
-        stack<shared_ptr<Song>> temp = history;
-        while (!temp.empty() && n--) {
-            out.push_back(temp.top());
-            temp.pop();
+// ================= Operation Log (Write-Ahead, Group Commit) =================
+// Every state mutation is appended to the current log segment before it is
+// applied, so a crash loses at most the last group-commit window. Segments
+// are named <snapshot>.wal.<generation>; a checkpoint rotates to a new
+// segment and, once its image is on disk, deletes the older ones.
+// Record layout (host byte order):
+//   u32 payload bytes, u32 crc32(payload),
+//   payload: u8 code, i64 a, i64 b, i64 c, u32 len + text1, u32 len + text2
+enum LogOpCode : uint8_t {
+    OP_NEW_SONG = 1,  // a = duration, b = expected id, text1 = title, text2 = artist
+    OP_APPEND,        // a = song
+    OP_DELETE,        // a = index
+    OP_MOVE,          // a = from index, b = to index
+    OP_REVERSE,
+    OP_PLAY,          // a = song, b = seconds, c = played at (ms)
+    OP_UNDO_PLAY,
+    OP_RATE,          // a = song, b = rating
+    OP_BLOCK,         // text1 = artist
+    OP_UNBLOCK,       // text1 = artist
+    OP_SAVE_AS,       // text1 = name
+    OP_OPEN_SAVED,    // text1 = name
+    OP_DROP_SAVED,    // text1 = name
+    OP_SAVE_SORTED,   // text1 = name, text2 = sort choice
+    OP_LAST = OP_SAVE_SORTED
+};
+
+struct LogOp {
+    LogOpCode code;
+    int64_t a, b, c;
+    string text1, text2;
+};
+
+LogOp make_op(LogOpCode code, int64_t a = 0, int64_t b = 0, int64_t c = 0,
+              const string& text1 = string(), const string& text2 = string()) {
+    return LogOp{code, a, b, c, text1, text2};
+}
+
+// Modules a log operation can touch.
+struct SystemState {
+    SongStore& store;
+    Playlist& playlist;
+    PlaylistLibrary& library;
+    SongLookup& lookup;
+    SongRatingBST& ratings;
+    FavoriteQueue& favorites;
+    PlaybackHistory& history;
+};
+
+// The lookup, rating tree and favorites follow the open playlist: a song
+// that leaves it (delete, opening another playlist) drops out of all three,
+// and one that comes back (append, undo, open) is re-indexed from the
+// rating and listen time the store kept.
+static void song_entered_playlist(SystemState& st, SongId song) {
+    st.lookup.add_song(song);
+    if (st.store.rating(song) > 0 && !st.ratings.contains(song))
+        st.ratings.insert_or_update(song, st.store.rating(song));
+    if (st.store.listen_time(song) > 0) st.favorites.add_or_update(song);
+}
+
+static void song_left_playlist(SystemState& st, SongId song) {
+    if (st.playlist.contains(song)) return; // another copy is still there
+    st.lookup.remove_song(song);
+    st.ratings.delete_song(song);
+    st.favorites.remove(song);
+}
+
+// Applies one operation without printing; shared by the command loop and
+// replay so both take exactly the same path. Returns:
+//   OP_NEW_SONG -> new id, OP_DELETE -> removed song,
+//   OP_UNDO_PLAY -> re-added song (negated if already present, 0 if no history),
+//   OP_BLOCK / OP_UNBLOCK -> set_artist_blocked result, OP_DROP_SAVED -> 1 if removed,
+//   otherwise 1 on success and 0 if the operation does not apply.
+int64_t apply_op(SystemState& st, const LogOp& op) {
+    switch (op.code) {
+    case OP_NEW_SONG:
+        if (op.b != (int64_t)st.store.capacity_ids() || op.a <= 0 || op.a > INT_MAX) return 0;
+        return st.store.add_song(op.text1, op.text2, (int)op.a);
+    case OP_APPEND:
+        if (op.a <= 0 || op.a >= (int64_t)st.store.capacity_ids()) return 0;
+        st.playlist.add_song((SongId)op.a);
+        song_entered_playlist(st, (SongId)op.a);
+        return 1;
+    case OP_DELETE: {
+        SongId song = op.a >= 0 && op.a < st.playlist.size() ? st.playlist.erase_at((int)op.a) : NO_SONG;
+        if (song) song_left_playlist(st, song);
+        return song;
+    }
+    case OP_MOVE:
+        if (op.a < 0 || op.b < 0 || op.a > INT_MAX || op.b > INT_MAX) return 0;
+        return st.playlist.splice((int)op.a, 1, (int)op.b);
+    case OP_REVERSE:
+        st.playlist.reverse();
+        return 1;
+    case OP_PLAY: {
+        if (op.a <= 0 || op.a >= (int64_t)st.store.capacity_ids()) return 0;
+        SongId song = (SongId)op.a;
+        st.store.add_listen_time(song, (int)op.b);
+        st.history.play(song, op.c);
+        st.favorites.add_or_update(song);
+        return 1;
+    }
+    case OP_UNDO_PLAY: {
+        SongId song = st.history.undo_last_play();
+        if (!song) return 0;
+        if (!st.playlist.add_unique(song)) return -(int64_t)song;
+        song_entered_playlist(st, song);
+        return song;
+    }
+    case OP_RATE:
+        if (op.a <= 0 || op.a >= (int64_t)st.store.capacity_ids() || op.b < 1 || op.b > 5) return 0;
+        st.ratings.insert_or_update((SongId)op.a, (int)op.b);
+        return 1;
+    case OP_BLOCK:
+    case OP_UNBLOCK:
+        return set_artist_blocked(op.text1, op.code == OP_BLOCK, st.store, st.playlist,
+                                  st.library, st.favorites);
+    case OP_SAVE_AS:
+        st.library.save(op.text1, st.playlist);
+        return 1;
+    case OP_OPEN_SAVED: {
+        const Playlist* saved = st.library.find(op.text1);
+        if (!saved) return 0;
+        // Keep the lookup, ratings and favorites in step with the songs of
+        // the open playlist.
+        vector<char> in_new(st.store.capacity_ids(), 0), in_old(st.store.capacity_ids(), 0);
+        vector<SongId> old_songs = st.playlist.all_songs(true), new_songs = saved->all_songs(true);
+        for (SongId s : new_songs) in_new[s] = 1;
+        for (SongId s : old_songs) in_old[s] = 1;
+        st.playlist = *saved;
+        for (SongId s : old_songs)
+            if (!in_new[s] && in_old[s]++ == 1) song_left_playlist(st, s);
+        for (SongId s : new_songs)
+            if (!in_old[s] && in_new[s]++ == 1) song_entered_playlist(st, s);
+        return 1;
+    }
+    case OP_DROP_SAVED:
+        return st.library.remove(op.text1);
+    case OP_SAVE_SORTED: {
+        vector<SongId> songs = st.playlist.all_songs();
+        if (!sort_by_choice(songs, st.store, op.text2)) return 0;
+        Playlist sorted(st.store);
+        sorted.append_bulk(songs);
+        st.library.save(op.text1, sorted);
+        return 1;
+    }
+    }
+    return 0;
+}
+
+static uint32_t crc32(const char* data, size_t n) {
+    static const vector<uint32_t> table = [] {
+        vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
         }
-        return out;
+        return t;
+    }();
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < n; ++i) c = table[(c ^ (uint8_t)data[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+static const size_t LOG_RECORD_HEADER = 8;
+static const size_t LOG_FIXED_PAYLOAD = 1 + 3 * sizeof(int64_t) + 2 * sizeof(uint32_t);
+
+static void encode_op(const LogOp& op, string& out) {
+    uint32_t bytes = (uint32_t)(LOG_FIXED_PAYLOAD + op.text1.size() + op.text2.size());
+    size_t start = out.size();
+    out.resize(start + LOG_RECORD_HEADER + bytes);
+    char* p = &out[start + LOG_RECORD_HEADER];
+    *p++ = (char)op.code;
+    const int64_t nums[3] = {op.a, op.b, op.c};
+    memcpy(p, nums, sizeof(nums)); p += sizeof(nums);
+    for (const string* text : {&op.text1, &op.text2}) {
+        uint32_t len = (uint32_t)text->size();
+        memcpy(p, &len, 4); p += 4;
+        memcpy(p, text->data(), len); p += len;
     }
-};
+    uint32_t crc = crc32(&out[start + LOG_RECORD_HEADER], bytes);
+    memcpy(&out[start], &bytes, 4);
+    memcpy(&out[start + 4], &crc, 4);
+}
 
-// ================= Song Rating Tree (BST) =================
-struct RatingNode {
-    int rating;
-    vector<shared_ptr<Song>> songs;
-    RatingNode* left;
-    RatingNode* right;
-    RatingNode(int r) : rating(r), left(nullptr), right(nullptr) {}
+// Verifies and decodes one record whose header starts at p.
+static bool decode_op(const char* p, LogOp& op) {
+    uint32_t bytes, crc;
+    memcpy(&bytes, p, 4);
+    memcpy(&crc, p + 4, 4);
+    p += LOG_RECORD_HEADER;
+    if (bytes < LOG_FIXED_PAYLOAD || crc32(p, bytes) != crc) return false;
+    const char* end = p + bytes;
+    if ((uint8_t)*p < OP_NEW_SONG || (uint8_t)*p > OP_LAST) return false;
+    op.code = (LogOpCode)(uint8_t)*p++;
+    int64_t nums[3];
+    memcpy(nums, p, sizeof(nums)); p += sizeof(nums);
+    op.a = nums[0]; op.b = nums[1]; op.c = nums[2];
+    for (string* text : {&op.text1, &op.text2}) {
+        uint32_t len;
+        if (end - p < 4) return false;
+        memcpy(&len, p, 4); p += 4;
+        if ((size_t)(end - p) < len) return false;
+        text->assign(p, len); p += len;
+    }
+    return p == end;
+}
+
+struct ReplayStats {
+    size_t applied = 0;
+    size_t segments = 0;
+    size_t truncated_bytes = 0;
+    uint64_t last_generation = 0;
+    double elapsed_ms = 0;
 };
 
-class SongRatingBST {
-    RatingNode* root;
+// Appends records on a background thread. Records are queued without
+// blocking; the writer drains everything queued so far with one write and
+// one fdatasync (group commit), so bursts of commands share a single sync.
+class OperationLog {
+    static const size_t GROUP_BYTES = 1 << 16;
+    static const int COMMIT_WINDOW_US = 2000;
+
+    mutex mu;
+    condition_variable cv;
+    condition_variable synced_cv;
+    string prefix;
+    int fd;
+    uint64_t generation;
+    string pending;
+    uint64_t appended;
+    uint64_t synced;
+    bool stopping;
+    string last_error;
+    thread writer;
 
-    RatingNode* _insert(RatingNode* node, shared_ptr<Song> s, int r) {
-        if (!node) {
-            node = new RatingNode(r);
-            node->songs.push_back(s);
-            return node;
+    static bool _write_all(int fd, const string& data) {
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+            if (n <= 0) return false;
+            done += (size_t)n;
         }
-        if (r < node->rating) node->left = _insert(node->left, s, r);
-        else if (r > node->rating) node->right = _insert(node->right, s, r);
-        else node->songs.push_back(s);
-        return node;
+        return true;
     }
 
-    RatingNode* _delete_song(RatingNode* node, int id) {
-        if (!node) return nullptr;
-        node->songs.erase(remove_if(node->songs.begin(), node->songs.end(),
-                                    [id](auto s){ return s->song_id == id; }),
-                          node->songs.end());
-        if (node->songs.empty()) {
-            if (!node->left) {
-                RatingNode* r = node->right;
-                delete node;
-                return r;
-            } else if (!node->right) {
-                RatingNode* l = node->left;
-                delete node;
-                return l;
+    void _run() {
+        SubsystemScope scope(SUB_LOG);
+        unique_lock<mutex> lock(mu);
+        while (true) {
+            cv.wait(lock, [this] { return !pending.empty() || stopping; });
+            if (pending.empty()) return;
+            // Give commands issued right behind this one a moment to join the batch.
+            cv.wait_for(lock, chrono::microseconds((long long)COMMIT_WINDOW_US),
+                        [this] { return stopping || pending.size() >= GROUP_BYTES; });
+            string batch;
+            batch.swap(pending);
+            int target = fd;
+            lock.unlock();
+            bool ok;
+            {
+                ScopedMetric timer(metric_log_commit);
+                ok = target >= 0 && _write_all(target, batch) && fdatasync(target) == 0;
             }
+            lock.lock();
+            if (!ok) last_error = "cannot write " + segment_path(prefix, generation);
+            synced += batch.size();
+            synced_cv.notify_all();
         }
-        node->left = _delete_song(node->left, id);
-        node->right = _delete_song(node->right, id);
-        return node;
     }
 
-    void _count_by_rating(RatingNode* node, map<int,int>& countMap) {
-        if (!node) return;
-        countMap[node->rating] += node->songs.size();
-        _count_by_rating(node->left, countMap);
-        _count_by_rating(node->right, countMap);
+    void _wait_synced(unique_lock<mutex>& lock) {
+        cv.notify_all();
+        synced_cv.wait(lock, [this] { return synced == appended; });
     }
 
-    void _free(RatingNode* node) {
-        if (!node) return;
-        _free(node->left); _free(node->right); delete node;
+    bool _open_segment(uint64_t gen) {
+        string path = segment_path(prefix, gen);
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        generation = gen;
+        if (fd < 0) last_error = "cannot open " + path;
+        return fd >= 0;
     }
 
 public:
-    SongRatingBST() : root(nullptr) {}
-    ~SongRatingBST() { _free(root); }
+    OperationLog() : fd(-1), generation(0), appended(0), synced(0), stopping(false) {
+        writer = thread(&OperationLog::_run, this);
+    }
+    ~OperationLog() {
+        flush();
+        {
+            lock_guard<mutex> lock(mu);
+            stopping = true;
+        }
+        cv.notify_all();
+        writer.join();
+        if (fd >= 0) ::close(fd);
+    }
+    OperationLog(const OperationLog&) = delete;
+    OperationLog& operator=(const OperationLog&) = delete;
+
+    static string segment_path(const string& prefix, uint64_t gen) { return prefix + to_string(gen); }
+
+    // Opens (or creates) segment gen for appending.
+    bool open(const string& log_prefix, uint64_t gen) {
+        lock_guard<mutex> lock(mu);
+        prefix = log_prefix;
+        return _open_segment(gen);
+    }
+
+    bool is_open() {
+        lock_guard<mutex> lock(mu);
+        return fd >= 0;
+    }
 
-    void insert_or_update(shared_ptr<Song> song, int r) {
-        if (song->rating != 0) {
-            root = _delete_song(root, song->song_id);
+    void append(const LogOp& op) {
+        {
+            lock_guard<mutex> lock(mu);
+            if (fd < 0) return;
+            ScopedMetric timer(metric_log_append);
+            size_t before = pending.size();
+            encode_op(op, pending);
+            appended += pending.size() - before;
         }
-        song->rating = r;
-        root = _insert(root, song, r);
+        cv.notify_all();
     }
-    void delete_song(int song_id) {
-        root = _delete_song(root, song_id);
+
+    // Blocks until every appended record is on disk; returns the last write
+    // error (empty if none) and clears it.
+    string flush() {
+        unique_lock<mutex> lock(mu);
+        _wait_synced(lock);
+        string error;
+        error.swap(last_error);
+        return error;
     }
-    map<int,int> rating_counts() {
-        map<int,int> counts;
-        _count_by_rating(root, counts);
-        return counts;
+
+    // Starts the next segment and returns its generation. A checkpoint
+    // captured right after this covers every record of older segments.
+    uint64_t rotate() {
+        unique_lock<mutex> lock(mu);
+        _wait_synced(lock);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        _open_segment(generation + 1);
+        return generation;
     }
-};
 
-// ================= Favorites (Max Heap) =================
-struct HeapItem {
-    int listen_time;
-    shared_ptr<Song> song;
-    bool operator<(const HeapItem& other) const {
-        return listen_time < other.listen_time;
+    // Deletes segments below gen (they are contiguous, so stop at the first gap).
+    static void remove_before(const string& prefix, uint64_t gen) {
+        while (gen-- > 0 && unlink(segment_path(prefix, gen).c_str()) == 0) {}
+    }
+
+    // Replays segments from gen upward. Records are scanned sequentially,
+    // checksummed and decoded on all cores, then applied in order (they are
+    // position-dependent). A torn or corrupt tail ends replay and is cut off
+    // so new records never follow garbage.
+    static bool replay(const string& prefix, uint64_t gen, SystemState& st, ReplayStats& stats, string& error) {
+        ScopedMetric timer(metric_log_replay);
+        auto start = chrono::steady_clock::now();
+        stats.last_generation = gen;
+        for (;; ++gen) {
+            string path = segment_path(prefix, gen);
+            if (access(path.c_str(), F_OK) != 0) break;
+            stats.last_generation = gen;
+            stats.segments++;
+            // offsets[i] is where record i starts; the last entry is where the
+            // final complete record ends.
+            vector<size_t> offsets(1, 0);
+            vector<LogOp> ops;
+            size_t file_size, valid = 0;
+            {
+                MappedFile file(path);
+                file_size = file.ok() ? file.size() : 0;
+                const char* base = file.data();
+                for (size_t pos = 0; file_size - pos >= LOG_RECORD_HEADER;) {
+                    uint32_t bytes;
+                    memcpy(&bytes, base + pos, 4);
+                    if (file_size - pos - LOG_RECORD_HEADER < bytes) break;
+                    pos += LOG_RECORD_HEADER + bytes;
+                    offsets.push_back(pos);
+                }
+                size_t records = offsets.size() - 1;
+                ops.resize(records);
+                vector<char> ok(records, 0);
+                auto decode_range = [&](size_t b, size_t e) {
+                    for (size_t i = b; i < e; ++i) ok[i] = decode_op(base + offsets[i], ops[i]);
+                };
+                unsigned workers = records >= 4096 ? max(1u, thread::hardware_concurrency()) : 1;
+                size_t chunk = (records + workers - 1) / workers;
+                vector<thread> threads;
+                for (unsigned w = 1; w < workers; ++w)
+                    threads.emplace_back([&, w]() {
+                        SubsystemScope scope(SUB_LOG);
+                        decode_range(min(records, w * chunk), min(records, (w + 1) * chunk));
+                    });
+                decode_range(0, min(records, chunk));
+                for (auto& t : threads) t.join();
+                while (valid < records && ok[valid]) valid++;
+            }
+            size_t good_bytes = offsets[valid];
+            for (size_t i = 0; i < valid; ++i) {
+                if (ops[i].code == OP_NEW_SONG && ops[i].b != (int64_t)st.store.capacity_ids()) {
+                    error = path + " does not match the snapshot";
+                    return false;
+                }
+                apply_op(st, ops[i]);
+                stats.applied++;
+            }
+            if (good_bytes < file_size) {
+                stats.truncated_bytes += file_size - good_bytes;
+                if (truncate(path.c_str(), (off_t)good_bytes) != 0) {
+                    error = "cannot truncate " + path;
+                    return false;
+                }
+                // Anything in later segments was written after the damage.
+                if (access(segment_path(prefix, gen + 1).c_str(), F_OK) == 0) {
+                    error = path + " is damaged before its end";
+                    return false;
+                }
+            }
+        }
+        stats.elapsed_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        return true;
     }
 };
 
-class FavoriteQueue {
-    priority_queue<HeapItem> heap;
-    unordered_map<int, int> listen_map;
+// ================= Command Input =================
+// Interactive sessions print the menu and prompts. Batch sessions (--batch
+// FILE, or "-" for stdin) read the same answer lines silently; blank lines
+// and lines starting with '#' are skipped where a menu option is expected.
+class CommandInput {
+    istream& in;
+    bool interactive;
 public:
-    void add_or_update(shared_ptr<Song> s) {
-        listen_map[s->song_id] = s->total_listen_time;
-        heap.push({s->total_listen_time, s});
-    }
-    vector<shared_ptr<Song>> get_top_favorites(int k = 5) {
-        vector<HeapItem> popped;
-        vector<shared_ptr<Song>> out;
-        int count = 0;
-        while (!heap.empty() && count < k) {
-            HeapItem top = heap.top(); heap.pop();
-            if (listen_map[top.song->song_id] == top.listen_time) {
-                out.push_back(top.song); count++;
-            }
-            popped.push_back(top);
-        }
-        for (auto& item : popped)
-            heap.push(item);
-        return out;
+    CommandInput(istream& stream, bool prompts) : in(stream), interactive(prompts) {}
+
+    bool is_interactive() const { return interactive; }
+
+    bool read(const char* prompt, string& out) {
+        if (interactive) cout << prompt;
+        if (!getline(in, out)) { out.clear(); return false; }
+        if (!out.empty() && out.back() == '\r') out.pop_back();
+        return true;
     }
 };
 
-// ================= Utility Functions =================
-vector<shared_ptr<Song>> quick_sort_songs(
-    const vector<shared_ptr<Song>>& songs,
-    function<bool(shared_ptr<Song>, shared_ptr<Song>)> cmp) 
-{
-    if (songs.size() <= 1) return songs;
-    auto pivot = songs[0];
-    vector<shared_ptr<Song>> less, more;
-    for (size_t i = 1; i < songs.size(); ++i) {
-        if (cmp(songs[i], pivot))
-            less.push_back(songs[i]);
-        else
-            more.push_back(songs[i]);
-    }
-    auto sorted_less = quick_sort_songs(less, cmp);
-    auto sorted_more = quick_sort_songs(more, cmp);
-    sorted_less.push_back(pivot);
-    sorted_less.insert(sorted_less.end(), sorted_more.begin(), sorted_more.end());
-    return sorted_less;
-}
-
-void playlist_duration_summary(const Playlist& playlist) {
-    auto songs = playlist.all_songs();
-    if (songs.empty()) {
-        cout << "[EMPTY] Playlist is empty.\n";
-        return;
+// ================= Main Program =================
+#ifndef PLAYWISE_NO_MAIN
+int main(int argc, char** argv) {
+    SongStore store;
+    Playlist playlist(store);
+    PlaylistLibrary library;
+    SongLookup lookup(store);
+    FavoriteQueue favorites(store);
+    SongRatingBST rating_tree(store);
+    SnapshotWriter snapshot_writer;
+
+    // Batch runs stay reproducible: no snapshot unless one is named explicitly.
+    string snapshot_path = "playwise.snap", batch_path;
+    bool use_snapshot = true, snapshot_named = false;
+    vector<long long> trend_windows_ms;
+    size_t history_size = 1024;
+    string history_spill;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--snapshot" && i + 1 < argc) { snapshot_path = argv[++i]; snapshot_named = true; }
+        else if (arg == "--batch" && i + 1 < argc) batch_path = argv[++i];
+        else if (arg == "--no-snapshot") use_snapshot = false;
+        else if (arg == "--trend-window" && i + 1 < argc && atoll(argv[i + 1]) > 0)
+            trend_windows_ms.push_back(atoll(argv[++i]) * 1000);
+        else if (arg == "--history-size" && i + 1 < argc && atoll(argv[i + 1]) > 0)
+            history_size = (size_t)atoll(argv[++i]);
+        else if (arg == "--history-spill" && i + 1 < argc) history_spill = argv[++i];
+        else {
+            cerr << "Usage: " << argv[0]
+                 << " [--batch FILE|-] [--snapshot PATH] [--no-snapshot] [--trend-window SECONDS]..."
+                    " [--history-size N] [--history-spill FILE]\n";
+            return 2;
+        }
     }
-    int total = 0;
-    auto longest = songs[0], shortest = songs[0];
-    for (auto& s : songs) {
-        total += s->duration;
-        if (s->duration > longest->duration) longest = s;
-        if (s->duration < shortest->duration) shortest = s;
-    }
-    cout << "Total Playtime: " << total << " sec\n";
-    cout << "Longest Song: " << longest->display() << "\n";
-    cout << "Shortest Song: " << shortest->display() << "\n";
-}
-
-unordered_set<string> blocked_artists;
-bool is_blocked_artist(const string& artist) {
-    string a = artist;
-    transform(a.begin(), a.end(), a.begin(), ::tolower);
-    return blocked_artists.count(a);
-}
-void block_artist(const string& artist) {
-    string a = artist;
-    transform(a.begin(), a.end(), a.begin(), ::tolower);
-    blocked_artists.insert(a);
-}
-
-void export_snapshot(const Playlist& playlist, PlaybackHistory& history,
-                     SongRatingBST& ratings) {
-    cout << "--- System Snapshot ---\n";
-    auto songs = playlist.all_songs();
-    sort(songs.begin(), songs.end(),
-         [](auto a, auto b){ return a->duration > b->duration; });
-    cout << "Top 5 Longest Songs:\n";
-    for (size_t i = 0; i < songs.size() && i < 5; i++)
-        cout << songs[i]->display() << "\n";
-
-    cout << "Recently Played:\n";
-    for (auto& s : history.recent(5))
-        cout << s->display() << "\n";
-
-    auto counts = ratings.rating_counts();
-    cout << "Song Count by Rating:\n";
-    for (auto& kv : counts)
-        cout << kv.first << " stars: " << kv.second << "\n";
-}
-
-void suggest_time_fitting_songs(const Playlist& playlist, int available_time_sec) {
-    auto songs = playlist.all_songs();
-    sort(songs.begin(), songs.end(), [](auto a, auto b) {
-        return a->duration < b->duration;  // Greedy: shortest first
-    });
+    if (!batch_path.empty() && !snapshot_named) use_snapshot = false;
+    PlaybackHistory history(store, history_size, history_spill);
+    if (!trend_windows_ms.empty()) history.set_trending_windows(trend_windows_ms);
 
-    cout << "\n[Suggestion] Songs that fit in " << available_time_sec << " seconds:\n";
-    int total = 0;
-    bool found = false;
-    for (auto& s : songs) {
-        if (total + s->duration <= available_time_sec) {
-            cout << "- " << s->display() << endl;
-            total += s->duration;
-            found = true;
+    ifstream batch_file;
+    if (!batch_path.empty() && batch_path != "-") {
+        batch_file.open(batch_path);
+        if (!batch_file) {
+            cerr << "[ERROR] Cannot open batch file " << batch_path << "\n";
+            return 1;
         }
     }
-    if (!found) cout << "[INFO] No songs fit within given duration.\n";
-    else cout << "[Total Duration] " << total << " seconds used.\n";
-}
+    CommandInput cmd(batch_file.is_open() ? (istream&)batch_file : cin, batch_path.empty());
+
+    SystemState state{store, playlist, library, lookup, rating_tree, favorites, history};
+    OperationLog oplog;
+    string log_prefix = snapshot_path + ".wal.";
+    uint64_t log_generation = 0;
+    if (use_snapshot && access(snapshot_path.c_str(), F_OK) == 0) {
+        auto start = chrono::steady_clock::now();
+        string error;
+        if (load_snapshot(snapshot_path, store, playlist, library, lookup, rating_tree, favorites, history,
+                          log_generation, error))
+            cout << "[INFO] Restored " << store.size() << " songs from " << snapshot_path << " in "
+                 << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms.\n";
+        else {
+            // Leave the image and its log alone so nothing is overwritten.
+            cout << "[WARN] Snapshot ignored: " << error << "\n";
+            cout << "[WARN] Snapshots and the operation log are off for this session.\n";
+            use_snapshot = false;
+        }
+    }
+    if (use_snapshot) {
+        ReplayStats replayed;
+        string error;
+        if (!OperationLog::replay(log_prefix, log_generation, state, replayed, error))
+            cout << "[WARN] Log replay stopped: " << error << "\n";
+        if (replayed.applied)
+            cout << "[INFO] Replayed " << replayed.applied << " logged operations in "
+                 << replayed.elapsed_ms << " ms.\n";
+        if (replayed.truncated_bytes)
+            cout << "[WARN] Discarded " << replayed.truncated_bytes << " bytes of damaged or incomplete log.\n";
+        log_generation = replayed.last_generation;
+        if (!oplog.open(log_prefix, log_generation))
+            cout << "[WARN] Operation log unavailable: " << oplog.flush() << "\n";
+    }
+    PlayIngestion ingestion(store, history, favorites);
+
+    // Plays are applied by the ingestion thread. Anything that changes
+    // listen times, history or favorites, or reads them in place, first
+    // waits for the plays submitted so far, then holds the state lock, so
+    // operations apply in log order. Favorites, recent plays, trending and
+    // Play Next read the published views instead.
+    auto settled_state = [&]() {
+        ingestion.flush();
+        return unique_lock<mutex>(ingestion.state_mutex());
+    };
+    // The latest published views. Interactive readers take them as they are;
+    // batch sessions first wait for the plays already submitted, so scripted
+    // output does not depend on the consumer's timing.
+    auto play_views = [&]() {
+        if (!cmd.is_interactive()) ingestion.flush();
+        return ingestion.views();
+    };
+    // Logs an operation, then applies it under the state lock.
+    auto log_and_apply = [&](const LogOp& op) {
+        auto state_lock = settled_state();
+        oplog.append(op);
+        return apply_op(state, op);
+    };
+    // Rotates the log and queues an image covering everything before the
+    // new segment; older segments are deleted once the image is on disk.
+    auto checkpoint = [&]() {
+        auto state_lock = settled_state();
+        uint64_t generation = oplog.is_open() ? oplog.rotate() : log_generation + 1;
+        log_generation = generation;
+        string log_error = oplog.flush();
+        if (!log_error.empty()) cout << "[WARN] Operation log: " << log_error << "\n";
+        string prefix = log_prefix;
+        snapshot_writer.submit(snapshot_path,
+            capture_snapshot(store, playlist, library, rating_tree, favorites, history, generation),
+            [prefix, generation]() { OperationLog::remove_before(prefix, generation); });
+    };
+    bool auto_extend = false;
+    // Logs and plays a song; with auto-extend on, also appends the top
+    // recommendation that is not in the playlist yet.
+    auto play_song = [&](SongId song) {
+        long long played_at = now_ms();
+        oplog.append(make_op(OP_PLAY, song, store.duration(song), played_at));
+        ingestion.submit(song, store.duration(song), played_at);
+        cout << "[PLAYING] " << store.display(song) << "\n";
+        if (!auto_extend) return;
+        // The next song follows this play, so wait until a view covers it.
+        ingestion.flush();
+        auto recs = pick_next(ingestion.views()->next, store, 1, [&](SongId s) { return playlist.contains(s); });
+        if (recs.empty()) return;
+        SongId next = recs[0].song;
+        log_and_apply(make_op(OP_APPEND, next));
+        cout << "[INFO] Auto-extend added: " << store.display(next) << "\n";
+    };
+    // Resolves a title to one song, asking for the artist only when several
+    // songs share the title. Falls back to the closest title when nothing
+    // matches exactly: a single best candidate is offered for confirmation,
+    // several are listed.
+    auto pick_by_title = [&](const string& title, bool include_blocked) {
+        vector<SongId> matches = lookup.find_all(title, include_blocked);
+        if (matches.empty()) {
+            auto close = lookup.fuzzy_search(title, default_fuzzy_distance(title.size()), false, 5);
+            if (close.empty()) return NO_SONG;
+            if (close.size() == 1 || close[1].distance > close[0].distance) {
+                string answer;
+                cmd.read(("Did you mean \"" + store.display(close[0].song) + "\"? (y/n): ").c_str(), answer);
+                return answer == "y" || answer == "Y" ? close[0].song : NO_SONG;
+            }
+            for (const FuzzyMatch& m : close) cout << "  Did you mean: " << store.display(m.song) << "\n";
+            return NO_SONG;
+        }
+        if (matches.size() == 1) return matches[0];
+        for (SongId s : matches) cout << "  " << store.display(s) << "\n";
+        string artist;
+        cmd.read("Enter artist name: ", artist);
+        return lookup.get(title, artist, include_blocked);
+    };
+
+    // Listings go out a page at a time through one long-lived buffer.
+    // Batch sessions default to whole listings so their output is stable.
+    OutputBuffer out(cout);
+    size_t page_size = cmd.is_interactive() ? 100 : 0;
+    OutputFormat format = OUTPUT_TEXT;
+    Listing listing;
+    bool listing_more = false;
+    auto show_listing = [&](Listing next) {
+        listing = std::move(next);
+        listing_more = render_page(out, store, listing, page_size, format);
+    };
 
-// ================= Main Program =================
-int main() {
-    Playlist playlist;
-    SongLookup lookup;
-    FavoriteQueue favorites;
-    SongRatingBST rating_tree;
-    PlaybackHistory history;
-
-    int song_counter = 1;
     string input;
 
     while (true) {
-        cout << "\n===========================================\n";
-        cout << "          PLAYWISE MUSIC SYSTEM\n";
-        cout << "===========================================\n";
-        cout << " 1.  Add Song\n";
-        cout << " 2.  Show Playlist\n";
-        cout << " 3.  Delete Song by Index\n";
-        cout << " 4.  Move Song\n";
-        cout << " 5.  Reverse Playlist\n";
-        cout << " 6.  Play Song\n";
-        cout << " 7.  Undo Last Play\n";
-        cout << " 8.  Rate Song\n";
-        cout << " 9.  Lookup Song by Title\n";
-        cout << "10.  Show Top Favorites\n";
-        cout << "11.  Block Artist\n";
-        cout << "12.  Duration Summary\n";
-        cout << "13.  Sort Playlist\n";
-        cout << "14.  Snapshot\n";
-        cout << "15.  Partial Search by Title\n";
-        cout << "16.  Suggest Songs by Time\n";
-        cout << "17.  Exit\n";
-        cout << "===========================================\n";
-        cout << "Choose an option: ";
-        getline(cin, input);
+        if (cmd.is_interactive()) {
+            cout << "\n===========================================\n";
+            cout << "          PLAYWISE MUSIC SYSTEM\n";
+            cout << "===========================================\n";
+            cout << " 1.  Add Song\n";
+            cout << " 2.  Show Playlist\n";
+            cout << " 3.  Delete Song by Index\n";
+            cout << " 4.  Move Song\n";
+            cout << " 5.  Reverse Playlist\n";
+            cout << " 6.  Play Song\n";
+            cout << " 7.  Undo Last Play\n";
+            cout << " 8.  Rate Song\n";
+            cout << " 9.  Lookup Song by Title\n";
+            cout << "10.  Show Top Favorites\n";
+            cout << "11.  Block Artist\n";
+            cout << "12.  Duration Summary\n";
+            cout << "13.  Sort Playlist\n";
+            cout << "14.  Snapshot\n";
+            cout << "15.  Partial Search by Title\n";
+            cout << "16.  Suggest Songs by Time\n";
+            cout << "17.  Exit\n";
+            cout << "18.  Import Catalog (CSV/binary)\n";
+            cout << "19.  Save Snapshot\n";
+            cout << "20.  Suggest Songs by Time (weighted)\n";
+            cout << "21.  Unblock Artist\n";
+            cout << "22.  Save Playlist As\n";
+            cout << "23.  Open Saved Playlist\n";
+            cout << "24.  List Saved Playlists\n";
+            cout << "25.  Delete Saved Playlist\n";
+            cout << "26.  Save Sorted Copy As\n";
+            cout << "27.  Show Stats\n";
+            cout << "28.  Dump Stats (JSON)\n";
+            cout << "29.  Fuzzy Search (titles and artists)\n";
+            cout << "30.  Play Next (recommended)\n";
+            cout << "31.  Toggle Auto-extend\n";
+            cout << "32.  Show Trending\n";
+            cout << "33.  Output Settings\n";
+            cout << "34.  Next Page\n";
+            cout << "35.  Export Catalog (binary)\n";
+            cout << "===========================================\n";
+        }
+        if (!cmd.read("Choose an option: ", input)) break;
+        if (!cmd.is_interactive() && (input.empty() || input[0] == '#')) continue;
 
         if (input == "1") {
             string title, artist, dstr;
             int duration;
-            cout << "Enter song title: "; getline(cin, title);
-            cout << "Enter artist name: "; getline(cin, artist);
-            if (is_blocked_artist(artist)) {
+            cmd.read("Enter song title: ", title);
+            cmd.read("Enter artist name: ", artist);
+            if (store.artist_index().is_blocked_name(artist)) {
                 cout << "[ERROR] Artist is blocked.\n";
                 continue;
             }
@@ -471,68 +4882,82 @@ int main() {
                 cout << "[ERROR] Duplicate song.\n";
                 continue;
             }
-            cout << "Enter duration (sec): "; getline(cin, dstr);
+            cmd.read("Enter duration (sec): ", dstr);
             if (!all_of(dstr.begin(), dstr.end(), ::isdigit) || stoi(dstr) <= 0) {
                 cout << "[ERROR] Invalid duration.\n";
                 continue;
             }
             duration = stoi(dstr);
-            auto song = make_shared<Song>(song_counter, title, artist, duration);
-            playlist.add_song(song); lookup.add_song(song);
-            song_counter++;
+            // Reuse the catalog entry (and its stats) if another playlist has it.
+            SongId song = store.find_song(title, artist);
+            if (!song || store.duration(song) != duration)
+                song = (SongId)log_and_apply(make_op(OP_NEW_SONG, duration, store.capacity_ids(), 0, title, artist));
+            log_and_apply(make_op(OP_APPEND, song));
+            ingestion.republish();
             cout << "[INFO] Song added.\n";
         }
-        else if (input == "2") playlist.show();
+        else if (input == "2") show_listing(playlist_listing(playlist));
         else if (input == "3") {
             string idxstr; int idx;
-            cout << "Enter index to delete: "; getline(cin, idxstr);
+            cmd.read("Enter index to delete: ", idxstr);
             if (!all_of(idxstr.begin(), idxstr.end(), ::isdigit)) {
                 cout << "[ERROR] Invalid input.\n";
                 continue;
             }
             idx = stoi(idxstr);
-            playlist.delete_song(idx, [&](shared_ptr<Song> s){ lookup.remove_song(s); rating_tree.delete_song(s->song_id); });
+            if (idx < 0 || idx >= playlist.size()) {
+                cout << "\n[ERROR] Invalid index. No song deleted.\n";
+                continue;
+            }
+            log_and_apply(make_op(OP_DELETE, idx));
+            cout << "\n[INFO] Song deleted successfully.\n";
+            ingestion.republish();
         }
         else if (input == "4") {
             string s1, s2; int from_idx, to_idx;
-            cout << "From index: "; getline(cin, s1);
-            cout << "To index: "; getline(cin, s2);
+            cmd.read("From index: ", s1);
+            cmd.read("To index: ", s2);
             if (!all_of(s1.begin(), s1.end(), ::isdigit) || !all_of(s2.begin(), s2.end(), ::isdigit)) {
                 cout << "[ERROR] Invalid input.\n";
                 continue;
             }
             from_idx = stoi(s1); to_idx = stoi(s2);
-            playlist.move_song(from_idx, to_idx);
+            if (from_idx < 0 || from_idx >= playlist.size() || to_idx < 0 || to_idx >= playlist.size()) {
+                cout << "\n[ERROR] Invalid index. Move operation aborted.\n";
+            } else if (from_idx == to_idx) {
+                cout << "\n[INFO] No movement needed (same index).\n";
+            } else {
+                log_and_apply(make_op(OP_MOVE, from_idx, to_idx));
+                cout << "\n[INFO] Song moved successfully.\n";
+            }
+        }
+        else if (input == "5") {
+            log_and_apply(make_op(OP_REVERSE));
+            cout << "\n[INFO] Playlist reversed successfully.\n";
         }
-        else if (input == "5") playlist.reverse_playlist();
         else if (input == "6") {
             string title;
-            cout << "Enter song title: "; getline(cin, title);
-            auto song = lookup.get_by_title(title);
+            cmd.read("Enter song title: ", title);
+            SongId song = pick_by_title(title, true);
             if (song) {
-                if (is_blocked_artist(song->artist)) {
+                if (store.is_blocked(song)) {
                     cout << "[ERROR] Artist is blocked.\n";
                     continue;
                 }
-                history.play(song);
-                song->total_listen_time += song->duration;
-                favorites.add_or_update(song);
-                cout << "[PLAYING] " << song->display() << endl;
+                play_song(song);
             } else cout << "[ERROR] Song not found.\n";
         }
         else if (input == "7") {
-            auto song = history.undo_last_play();
-            if (song) {
-                if (!playlist.exists(song->title, song->artist)) {
-                    playlist.add_song(song);
-                    cout << "[INFO] Re-added: " << song->display() << endl;
-                } else cout << "[WARN] Song already exists.\n";
-            } else cout << "[WARN] No history.\n";
+            int64_t song = log_and_apply(make_op(OP_UNDO_PLAY));
+            if (song > 0) cout << "[INFO] Re-added: " << store.display((SongId)song) << "\n";
+            else if (song < 0) cout << "[WARN] Song already exists.\n";
+            else cout << "[WARN] No history.\n";
+            ingestion.republish();
         }
         else if (input == "8") {
             string title, rstr; int rating;
-            cout << "Enter song title: "; getline(cin, title);
-            cout << "Enter rating (1-5): "; getline(cin, rstr);
+            cmd.read("Enter song title: ", title);
+            cmd.read("Enter rating (1-5): ", rstr);
             if (!all_of(rstr.begin(), rstr.end(), ::isdigit)) {
                 cout << "[ERROR] Invalid rating.\n";
                 continue;
@@ -542,62 +4967,242 @@ int main() {
                 cout << "[ERROR] Rating must be 1–5.\n";
                 continue;
             }
-            auto song = lookup.get_by_title(title);
+            SongId song = pick_by_title(title, false);
             if (song) {
-                rating_tree.insert_or_update(song, rating);
+                log_and_apply(make_op(OP_RATE, song, rating));
                 cout << "[INFO] Rating updated.\n";
             } else cout << "[ERROR] Song not found.\n";
         }
         else if (input == "9") {
             string title;
-            cout << "Enter title: "; getline(cin, title);
-            auto song = lookup.get_by_title(title);
-            cout << (song ? "[FOUND] " + song->display() : "[NOT FOUND]") << endl;
+            cmd.read("Enter title: ", title);
+            vector<SongId> matches = lookup.find_all(title);
+            for (SongId s : matches) cout << "[FOUND] " << store.display(s) << "\n";
+            if (matches.empty()) {
+                cout << "[NOT FOUND]\n";
+                for (const FuzzyMatch& m : lookup.fuzzy_search(title, default_fuzzy_distance(title.size()), false, 5))
+                    cout << "  Did you mean: " << store.display(m.song) << "\n";
+            }
         }
         else if (input == "10") {
-            for (auto& s : favorites.get_top_favorites())
-                cout << s->title << " - " << s->total_listen_time << " sec\n";
+            auto views = play_views();
+            const vector<HeapItem>& top = views->top_favorites;
+            for (size_t i = 0; i < top.size() && i < 5; ++i)
+                cout << store.title(top[i].song) << " - " << top[i].listen_time << " sec\n";
+        }
+        else if (input == "32") {
+            show_trending(*play_views(), store, now_ms());
         }
         else if (input == "11") {
             string artist;
-            cout << "Enter artist: "; getline(cin, artist);
-            block_artist(artist);
+            cmd.read("Enter artist: ", artist);
+            int64_t hidden = log_and_apply(make_op(OP_BLOCK, 0, 0, 0, artist));
+            ingestion.republish();
             cout << "[INFO] Artist blocked.\n";
+            if (hidden > 0) cout << "[INFO] " << hidden << " song(s) hidden.\n";
         }
-        else if (input == "12") playlist_duration_summary(playlist);
+        else if (input == "12") playlist_duration_summary(playlist, store);
         else if (input == "13") {
-            cout << "Sort by (1=Title, 2=Duration, 3=Recently Added): ";
-            string choice; getline(cin, choice);
+            string choice;
+            cmd.read("Sort by (1=Title, 2=Duration, 3=Recently Added, 4=Artist/Duration/Title): ", choice);
             auto songs = playlist.all_songs();
-            if (choice == "1")
-                songs = quick_sort_songs(songs, [](auto a, auto b){ return a->title < b->title; });
-            else if (choice == "2")
-                songs = quick_sort_songs(songs, [](auto a, auto b){ return a->duration < b->duration; });
-            else if (choice == "3")
-                songs = quick_sort_songs(songs, [](auto a, auto b){ return a->song_id > b->song_id; });
-            for (auto& s : songs) cout << s->display() << "\n";
-        }
-        else if (input == "14") export_snapshot(playlist, history, rating_tree);
+            sort_by_choice(songs, store, choice);
+            show_listing(vector_listing(std::move(songs), ""));
+        }
+        else if (input == "14") {
+            export_snapshot(playlist, store, *play_views(), rating_tree);
+            cout << "Total Plays: " << ingestion.total_plays() << " ("
+                 << ingestion.total_listen_seconds() << " sec listened)\n";
+        }
         else if (input == "15") {
             string term;
-            cout << "Enter partial title: "; getline(cin, term);
-            auto results = lookup.search_by_partial_title(term);
-            if (results.empty()) cout << "[NOT FOUND]\n";
-            else for (auto& s : results) cout << s->display() << "\n";
+            cmd.read("Enter partial title (end with * for titles starting with it): ", term);
+            bool prefix = term.size() > 1 && term.back() == '*';
+            if (prefix) term.pop_back();
+            show_listing(search_listing(lookup, term, prefix));
         }
         else if (input == "16") {
             string tstr;
-            cout << "Enter available time in seconds: ";
-            getline(cin, tstr);
-            if (!all_of(tstr.begin(), tstr.end(), ::isdigit)) {
+            cmd.read("Enter available time in seconds: ", tstr);
+            if (tstr.empty() || tstr.size() > 9 || !all_of(tstr.begin(), tstr.end(), ::isdigit)) {
                 cout << "[ERROR] Invalid input.\n";
                 continue;
             }
             int time_limit = stoi(tstr);
-            suggest_time_fitting_songs(playlist, time_limit);
+            auto state_lock = settled_state();
+            suggest_time_fitting_songs(playlist, store, time_limit);
+        }
+        else if (input == "20") {
+            string tstr, choice, approx;
+            cmd.read("Enter available time in seconds: ", tstr);
+            cmd.read("Weight by (1=Rating, 2=Listen Time): ", choice);
+            cmd.read("Approximate for large playlists? (y/n): ", approx);
+            if (tstr.empty() || tstr.size() > 9 || !all_of(tstr.begin(), tstr.end(), ::isdigit) ||
+                (choice != "1" && choice != "2")) {
+                cout << "[ERROR] Invalid input.\n";
+                continue;
+            }
+            auto state_lock = settled_state();
+            suggest_time_fitting_songs(playlist, store, stoi(tstr),
+                                       choice == "1" ? FILL_RATING : FILL_LISTEN_TIME, approx == "y");
+        }
+        else if (input == "21") {
+            string artist;
+            cmd.read("Enter artist: ", artist);
+            int64_t restored = log_and_apply(make_op(OP_UNBLOCK, 0, 0, 0, artist));
+            ingestion.republish();
+            if (restored < 0) cout << "[WARN] Artist was not blocked.\n";
+            else cout << "[INFO] Artist unblocked. " << restored << " song(s) restored.\n";
+        }
+        else if (input == "22") {
+            string name;
+            cmd.read("Enter playlist name: ", name);
+            if (name.empty()) { cout << "[ERROR] Invalid name.\n"; continue; }
+            log_and_apply(make_op(OP_SAVE_AS, 0, 0, 0, name));
+            cout << "[INFO] Playlist saved as '" << name << "'.\n";
+        }
+        else if (input == "23") {
+            string name;
+            cmd.read("Enter playlist name: ", name);
+            if (!library.find(name)) { cout << "[ERROR] No saved playlist named '" << name << "'.\n"; continue; }
+            log_and_apply(make_op(OP_OPEN_SAVED, 0, 0, 0, name));
+            ingestion.republish();
+            cout << "[INFO] Opened '" << name << "' (" << playlist.size() << " songs).\n";
+        }
+        else if (input == "24") {
+            if (!library.size()) cout << "[EMPTY] No saved playlists.\n";
+            for (auto& kv : library.all())
+                cout << kv.first << " - " << kv.second.size() << " songs, "
+                     << kv.second.total_duration() << " sec\n";
+        }
+        else if (input == "25") {
+            string name;
+            cmd.read("Enter playlist name: ", name);
+            if (!library.find(name)) { cout << "[ERROR] No saved playlist named '" << name << "'.\n"; continue; }
+            log_and_apply(make_op(OP_DROP_SAVED, 0, 0, 0, name));
+            cout << "[INFO] Deleted '" << name << "'.\n";
+        }
+        else if (input == "26") {
+            string choice, name;
+            cmd.read("Sort by (1=Title, 2=Duration, 3=Recently Added, 4=Artist/Duration/Title): ", choice);
+            cmd.read("Enter playlist name: ", name);
+            if (name.empty() || choice.size() != 1 || choice[0] < '1' || choice[0] > '4') {
+                cout << "[ERROR] Invalid input.\n";
+                continue;
+            }
+            log_and_apply(make_op(OP_SAVE_SORTED, 0, 0, 0, name, choice));
+            cout << "[INFO] Sorted copy saved as '" << name << "'.\n";
+        }
+        else if (input == "27") print_stats(cout);
+        else if (input == "28") {
+            string path;
+            cmd.read("Enter output path (- for screen): ", path);
+            if (path.empty() || path == "-") { dump_stats_json(cout); continue; }
+            ofstream out(path);
+            if (!out) { cout << "[ERROR] Cannot open " << path << ".\n"; continue; }
+            dump_stats_json(out);
+            cout << "[INFO] Stats written to " << path << ".\n";
+        }
+        else if (input == "29") {
+            string text;
+            cmd.read("Enter search text: ", text);
+            auto results = lookup.fuzzy_search(text, default_fuzzy_distance(text.size()), true, 20);
+            if (results.empty()) cout << "[NOT FOUND]\n";
+            for (const FuzzyMatch& m : results)
+                cout << store.display(m.song) << " (" << m.distance << " edit"
+                     << (m.distance == 1 ? "" : "s") << (m.by_artist ? ", artist" : "") << ")\n";
+        }
+        else if (input == "30") {
+            auto recs = pick_next(play_views()->next, store, 5, [](SongId) { return false; });
+            if (recs.empty()) {
+                cout << "[INFO] No recommendations yet; play a few songs first.\n";
+                continue;
+            }
+            for (const Recommendation& r : recs) cout << "[NEXT] " << store.display(r.song) << "\n";
+            play_song(recs[0].song);
+        }
+        else if (input == "31") {
+            auto_extend = !auto_extend;
+            cout << "[INFO] Auto-extend " << (auto_extend ? "on" : "off") << ".\n";
+        }
+        else if (input == "33") {
+            string size_str, format_str;
+            cmd.read("Page size (0 = all): ", size_str);
+            if (!size_str.empty()) {
+                if (size_str.size() > 9 || !all_of(size_str.begin(), size_str.end(), ::isdigit)) {
+                    cout << "[ERROR] Invalid page size.\n";
+                    continue;
+                }
+                page_size = stoul(size_str);
+            }
+            cmd.read("Format (text/tsv): ", format_str);
+            if (format_str == "text") format = OUTPUT_TEXT;
+            else if (format_str == "tsv") format = OUTPUT_TSV;
+            else if (!format_str.empty()) {
+                cout << "[ERROR] Unknown format.\n";
+                continue;
+            }
+            cout << "[INFO] Page size " << page_size << ", format " << (format == OUTPUT_TSV ? "tsv" : "text")
+                 << ".\n";
+        }
+        else if (input == "34") {
+            if (!listing_more) {
+                cout << "[INFO] Nothing more to show.\n";
+                continue;
+            }
+            listing_more = render_page(out, store, listing, page_size, format);
+        }
+        else if (input == "35") {
+            string path;
+            cmd.read("Enter output path: ", path);
+            if (path.empty()) { cout << "[ERROR] Invalid path.\n"; continue; }
+            vector<SongId> songs = playlist.all_songs(true);
+            if (!write_binary_catalog(path, store, songs)) {
+                cout << "[ERROR] Cannot write " << path << ".\n";
+                continue;
+            }
+            cout << "[INFO] Exported " << songs.size() << " songs to " << path << ".\n";
         }
         else if (input == "17") break;
+        else if (input == "19") {
+            if (!use_snapshot) {
+                cout << "[ERROR] Snapshots are disabled for this session.\n";
+                continue;
+            }
+            checkpoint();
+            cout << "[INFO] Checkpoint queued to " << snapshot_path << ".\n";
+        }
+        else if (input == "18") {
+            string path;
+            cmd.read("Enter catalog path: ", path);
+            ImportStats stats;
+            bool imported;
+            {
+                lock_guard<mutex> state_lock(ingestion.state_mutex());
+                imported = import_catalog(path, store, playlist, lookup, rating_tree, stats);
+            }
+            if (!imported) {
+                cout << "[ERROR] Could not open catalog.\n";
+                continue;
+            }
+            // Imports are not logged; make them durable with a checkpoint.
+            if (use_snapshot) {
+                checkpoint();
+                string error = snapshot_writer.wait_idle();
+                if (!error.empty()) cout << "[ERROR] Snapshot not saved: " << error << "\n";
+            }
+            cout << "[INFO] Imported " << stats.imported << " songs in "
+                 << stats.elapsed_ms << " ms (" << stats.blocked << " blocked, "
+                 << stats.duplicates << " duplicates, " << stats.malformed << " malformed).\n";
+        }
         else cout << "[ERROR] Invalid choice.\n";
     }
+    ingestion.flush();
+    if (use_snapshot) {
+        checkpoint();
+        string error = snapshot_writer.wait_idle();
+        if (!error.empty()) cout << "[ERROR] Snapshot not saved: " << error << "\n";
+    }
     return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,270 @@
+// PlayWise benchmark suite.
+//
+// Build:  g++ -std=c++14 -O2 -pthread bench/playwise_bench.cpp -o playwise_bench
+// Run:    ./playwise_bench [--max N] [--ops K] [--seed S]
+//
+// Generates synthetic catalogs of 1K, 10K, ... up to --max songs (default
+// 1M, up to 10M) and reports throughput and latency percentiles for every
+// module. Operations that print are run with cout muted.
+
+#define PLAYWISE_NO_MAIN
+#include "../Untitled-1.cpp"
+
+#include <cstdio>
+#include <sstream>
+
+struct BenchConfig {
+    size_t max_songs;
+    size_t ops;
+    unsigned seed;
+};
+
+// Discards everything written to cout while in scope.
+class MuteCout {
+    streambuf* saved;
+    ostringstream sink;
+public:
+    MuteCout() : saved(cout.rdbuf(sink.rdbuf())) {}
+    ~MuteCout() { cout.rdbuf(saved); }
+};
+
+static void report(const char* name, size_t n, vector<double>& ns) {
+    if (ns.empty()) return;
+    sort(ns.begin(), ns.end());
+    double total = 0;
+    for (double v : ns) total += v;
+    auto pct = [&](double p) { return ns[min(ns.size() - 1, (size_t)(p * ns.size()))] / 1000.0; };
+    printf("%-22s %10zu %8zu %14.0f %10.2f %10.2f %10.2f %12.2f\n", name, n, ns.size(),
+           ns.size() / (total / 1e9), pct(0.50), pct(0.90), pct(0.99), ns.back() / 1000.0);
+}
+
+template <typename Op>
+static void measure(const char* name, size_t n, size_t ops, Op op) {
+    vector<double> ns;
+    ns.reserve(ops);
+    for (size_t i = 0; i < ops; ++i) {
+        auto start = chrono::steady_clock::now();
+        op(i);
+        ns.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - start).count());
+    }
+    report(name, n, ns);
+}
+
+static const char* const WORDS[] = {
+    "love", "night", "dance", "heart", "fire", "rain", "summer", "dream",
+    "blue", "road", "light", "wild", "gold", "river", "echo", "storm"
+};
+
+// Adds n synthetic songs (about n / 10 artists, 60-600 s, random ratings)
+// through the same bulk path the catalog importer uses.
+static void generate_catalog(size_t n, mt19937& rng, SongStore& store, Playlist& playlist,
+                             SongLookup& lookup, SongRatingBST& ratings) {
+    store.reserve(n);
+    vector<SongId> ids;
+    ids.reserve(n);
+    size_t artists = max<size_t>(1, n / 10);
+    for (size_t i = 0; i < n; ++i) {
+        string title = string(WORDS[rng() % 16]) + " " + WORDS[rng() % 16] + " " + to_string(i);
+        string artist = "Artist " + to_string(rng() % artists);
+        SongId id = store.add_song(title, artist, 60 + (int)(rng() % 541));
+        store.set_rating(id, (int)(rng() % 6));
+        ids.push_back(id);
+    }
+    playlist.append_bulk(ids);
+    lookup.add_bulk(ids);
+    ratings.add_bulk(ids);
+}
+
+// Regression check for large windows: one holding the whole playlist must
+// return every song, and one holding half of it must fill at least as
+// much as the greedy longest-first pass, in exact and approximate mode.
+static bool check_time_fill(const Playlist& playlist, const SongStore& store) {
+    vector<SongId> songs = playlist.all_songs();
+    long long total = 0;
+    for (SongId s : songs) total += store.duration(s);
+    if (total > INT_MAX) return true;
+    vector<SongId> longest = songs;
+    sort(longest.begin(), longest.end(), [&](SongId a, SongId b) { return store.duration(a) > store.duration(b); });
+    bool ok = true;
+    for (int window : {(int)total, (int)(total / 2)}) {
+        long long greedy = 0;
+        for (SongId s : longest)
+            if (greedy + store.duration(s) <= window) greedy += store.duration(s);
+        for (bool approximate : {false, true}) {
+            TimeFillPlan plan = TimeFillPlanner(store, FILL_TIME).plan(songs, window, 0, approximate);
+            long long filled = plan.fills.empty() ? 0 : plan.fills[0].total_seconds;
+            if (filled > window || filled < greedy || (window == total && filled != total)) {
+                fprintf(stderr, "[ERROR] time fill: window %d (%s) filled %lld, greedy %lld\n", window,
+                        approximate ? "approximate" : "exact", filled, greedy);
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+static void run_size(size_t n, const BenchConfig& cfg) {
+    mt19937 rng(cfg.seed);
+    SongStore store;
+    Playlist playlist(store);
+    SongLookup lookup(store);
+    SongRatingBST ratings(store);
+    FavoriteQueue favorites(store);
+
+    auto start = chrono::steady_clock::now();
+    generate_catalog(n, rng, store, playlist, lookup, ratings);
+    double build_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    printf("%-22s %10zu %8d %14.0f %10s %10s %10s %12.2f\n", "catalog_build", n, 1,
+           n / (build_ms / 1000.0), "-", "-", "-", build_ms * 1000.0);
+
+    size_t ops = cfg.ops;
+    MuteCout mute;
+    auto random_song = [&]() { return (SongId)(1 + rng() % store.size()); };
+
+    measure("playlist_add", n, ops, [&](size_t i) {
+        playlist.add_song((SongId)(1 + i % store.size()));
+    });
+    measure("playlist_delete", n, ops, [&](size_t) {
+        playlist.erase_at((int)(rng() % playlist.size()));
+    });
+    measure("playlist_move", n, ops, [&](size_t) {
+        playlist.move_song((int)(rng() % playlist.size()), (int)(rng() % playlist.size()));
+    });
+    measure("playlist_reverse", n, ops, [&](size_t) { playlist.reverse_playlist(); });
+    measure("playlist_fork_edit", n, ops, [&](size_t) {
+        Playlist fork(playlist);
+        fork.erase_at((int)(rng() % fork.size()));
+    });
+    measure("duration_summary", n, ops, [&](size_t) { playlist_duration_summary(playlist, store); });
+    measure("top5_longest", n, ops, [&](size_t) {
+        volatile size_t k = playlist.top_by_duration(5).size();
+        (void)k;
+    });
+    measure("lookup_exact", n, ops, [&](size_t) {
+        volatile SongId s = lookup.get_by_title(store.title(random_song()));
+        (void)s;
+    });
+    measure("lookup_partial_lim20", n, ops, [&](size_t) {
+        string term = WORDS[rng() % 16];
+        volatile size_t hits = lookup.search_by_partial_title(term, 20).size();
+        (void)hits;
+    });
+    measure("lookup_fuzzy_1typo", n, ops, [&](size_t) {
+        string title = store.title(random_song());
+        title[rng() % title.size()] = 'q';
+        volatile size_t hits = lookup.fuzzy_search(title, 2, true, 10).size();
+        (void)hits;
+    });
+    measure("rating_update", n, ops, [&](size_t) {
+        ratings.insert_or_update(random_song(), 1 + (int)(rng() % 5));
+    });
+    measure("favorites_play", n, ops, [&](size_t) {
+        SongId s = random_song();
+        store.add_listen_time(s, store.duration(s));
+        favorites.add_or_update(s);
+    });
+    measure("favorites_top10", n, ops, [&](size_t) {
+        volatile size_t k = favorites.get_top_favorites(10).size();
+        (void)k;
+    });
+    {
+        PlaybackHistory history(store);
+        PlayIngestion ingestion(store, history, favorites);
+        measure("ingest_submit", n, ops, [&](size_t i) {
+            SongId s = random_song();
+            ingestion.submit(s, store.duration(s), (long long)i);
+        });
+        ingestion.flush();
+
+        // Four producers at once; one line for aggregate throughput.
+        const unsigned producers = 4;
+        size_t per_thread = ops * 10;
+        auto begin = chrono::steady_clock::now();
+        vector<thread> threads;
+        for (unsigned t = 0; t < producers; ++t)
+            threads.emplace_back([&, t]() {
+                mt19937 local(cfg.seed + t);
+                for (size_t i = 0; i < per_thread; ++i) {
+                    SongId s = (SongId)(1 + local() % store.size());
+                    ingestion.submit(s, store.duration(s), (long long)i);
+                }
+            });
+        for (auto& th : threads) th.join();
+        ingestion.flush();
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+        printf("%-22s %10zu %8zu %14.0f %10s %10s %10s %12.2f\n", "ingest_4_producers", n,
+                per_thread * producers, per_thread * producers / (ms / 1000.0), "-", "-", "-", ms * 1000.0);
+
+        // The plays above also fed the co-play model.
+        measure("recommend_next", n, ops, [&](size_t) {
+            volatile size_t k = recommend_next(history, store, 5, [](SongId) { return false; }).size();
+            (void)k;
+        });
+    }
+
+    {
+        // Group-commit appends, then a full replay of what was written.
+        string prefix = "playwise_bench.wal.";
+        unlink(OperationLog::segment_path(prefix, 0).c_str());
+        {
+            OperationLog log;
+            log.open(prefix, 0);
+            measure("oplog_append", n, ops * 10, [&](size_t) {
+                log.append(make_op(OP_RATE, random_song(), 1 + (int)(rng() % 5)));
+            });
+            log.flush();
+        }
+        PlaylistLibrary library;
+        PlaybackHistory history(store);
+        SystemState st{store, playlist, library, lookup, ratings, favorites, history};
+        ReplayStats stats;
+        string error;
+        OperationLog::replay(prefix, 0, st, stats, error);
+        unlink(OperationLog::segment_path(prefix, 0).c_str());
+        printf("%-22s %10zu %8zu %14.0f %10s %10s %10s %12.2f\n", "oplog_replay", n, stats.applied,
+               stats.applied / (stats.elapsed_ms / 1000.0), "-", "-", "-", stats.elapsed_ms * 1000.0);
+    }
+
+    size_t heavy_runs = n >= 1000000 ? 3 : 10;
+    {
+        // Full playlist listing as Show Playlist renders it, into /dev/null.
+        ofstream null_out("/dev/null");
+        OutputBuffer out(null_out);
+        measure("render_playlist", n, heavy_runs, [&](size_t) {
+            Listing listing = playlist_listing(playlist);
+            render_page(out, store, listing, 0, OUTPUT_TEXT);
+        });
+        measure("render_page_100", n, ops, [&](size_t) {
+            Listing listing = playlist_listing(playlist);
+            listing.next_offset = rng() % playlist.size();
+            render_page(out, store, listing, 100, OUTPUT_TEXT);
+        });
+    }
+    measure("sort_artist_dur_title", n, heavy_runs, [&](size_t) {
+        vector<SongId> songs = playlist.all_songs();
+        sort_songs(songs, store, ThenBy<ByArtist, ThenBy<ByDuration, ByTitle>>(), n >= 100000);
+    });
+    measure("suggest_time_fit", n, heavy_runs, [&](size_t) {
+        suggest_time_fitting_songs(playlist, store, 3600);
+    });
+    if (!check_time_fill(playlist, store)) exit(1);
+}
+
+int main(int argc, char** argv) {
+    BenchConfig cfg = {1000000, 1000, 42};
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string arg = argv[i];
+        if (arg == "--max") cfg.max_songs = stoul(argv[i + 1]);
+        else if (arg == "--ops") cfg.ops = stoul(argv[i + 1]);
+        else if (arg == "--seed") cfg.seed = (unsigned)stoul(argv[i + 1]);
+        else {
+            fprintf(stderr, "Usage: %s [--max N] [--ops K] [--seed S]\n", argv[0]);
+            return 2;
+        }
+    }
+    printf("%-22s %10s %8s %14s %10s %10s %10s %12s\n",
+           "benchmark", "songs", "ops", "ops/sec", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+    for (size_t n = 1000; n <= cfg.max_songs && n <= 10000000; n *= 10)
+        run_size(n, cfg);
+    return 0;
+}